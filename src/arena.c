@@ -0,0 +1,107 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "arena.h"
+
+#define ARENA_CHUNK_SIZE 0x10000 // chunks are aligned to their size
+#define ARENA_ALIGN      8
+#define ARENA_BIG        (ARENA_CHUNK_SIZE / 8) // bigger gets a chunk of its own
+
+/*
+ * While a thread allocates from a chunk, live carries ARENA_BIAS on top of
+ * the real count, so allocating never touches the atomic and the chunk can't
+ * be released under the allocator. Retiring the chunk swaps the bias for the
+ * number of objects handed out.
+*/
+#define ARENA_BIAS (SIZE_MAX / 2)
+
+typedef struct {
+	atomic_size_t live;
+	size_t size;
+} Arena_chunk;
+
+#define ARENA_HEADER ((sizeof(Arena_chunk) + 15) & ~(size_t) 15)
+
+static __thread struct {
+	Arena_chunk *chunk;
+	size_t used;
+	size_t count;
+} current;
+
+static atomic_size_t bytes_live;
+static atomic_size_t bytes_peak;
+
+static Arena_chunk *chunk_new(size_t size, size_t live) {
+	Arena_chunk *c = (Arena_chunk *) aligned_alloc(ARENA_CHUNK_SIZE, size);
+	if (!c) {
+		return NULL;
+	}
+	atomic_init(&c->live, live);
+	c->size = size;
+
+	size_t now = atomic_fetch_add_explicit(&bytes_live, size, memory_order_relaxed) + size;
+	size_t peak = atomic_load_explicit(&bytes_peak, memory_order_relaxed);
+	while (now > peak && !atomic_compare_exchange_weak_explicit(&bytes_peak, &peak, now,
+		memory_order_relaxed, memory_order_relaxed));
+	return c;
+}
+
+static void chunk_release(Arena_chunk *c) {
+	atomic_fetch_sub_explicit(&bytes_live, c->size, memory_order_relaxed);
+	free(c);
+}
+
+// drop n references, the last one out releases the chunk
+static inline void chunk_put(Arena_chunk *c, size_t n) {
+	if (atomic_fetch_sub_explicit(&c->live, n, memory_order_acq_rel) == n) {
+		chunk_release(c);
+	}
+}
+
+static void chunk_retire(void) {
+	if (current.chunk) {
+		chunk_put(current.chunk, ARENA_BIAS - current.count);
+		current.chunk = NULL;
+	}
+}
+
+void *arena_alloc(size_t size) {
+	size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+	if (size > ARENA_BIG) {
+		size_t total = (ARENA_HEADER + size + ARENA_CHUNK_SIZE - 1) & ~(size_t) (ARENA_CHUNK_SIZE - 1);
+		Arena_chunk *c = chunk_new(total, 1);
+		if (!c) {
+			return NULL;
+		}
+		return memset((char *) c + ARENA_HEADER, 0, size);
+	}
+
+	if (!current.chunk || current.used + size > ARENA_CHUNK_SIZE) {
+		chunk_retire();
+		if ((current.chunk = chunk_new(ARENA_CHUNK_SIZE, ARENA_BIAS)) == NULL) {
+			return NULL;
+		}
+		current.used = ARENA_HEADER;
+		current.count = 0;
+	}
+	void *ret = (char *) current.chunk + current.used;
+	current.used += size;
+	current.count++;
+	return memset(ret, 0, size);
+}
+
+void arena_free(void *ptr) {
+	if (ptr) {
+		chunk_put((Arena_chunk *) ((uintptr_t) ptr & ~(uintptr_t) (ARENA_CHUNK_SIZE - 1)), 1);
+	}
+}
+
+void arena_thread_done(void) {
+	chunk_retire();
+}
+
+void arena_stats(size_t *live, size_t *peak) {
+	*live = atomic_load_explicit(&bytes_live, memory_order_relaxed);
+	*peak = atomic_load_explicit(&bytes_peak, memory_order_relaxed);
+}
@@ -0,0 +1,33 @@
+#ifndef _ARENAGUARD
+#define _ARENAGUARD 1
+#include <stddef.h>
+
+/*
+ * Bump allocator for small objects that are made by one thread and freed,
+ * one at a time, by another. Every thread allocates from its own 64KB chunk,
+ * a chunk goes back to the system in one go when the last object in it is
+ * freed and the thread that made it moved on to a new chunk.
+*/
+
+/*
+ * returns size zeroed bytes owned by the calling thread's current chunk, NULL
+ * if memory ran out
+*/
+void *arena_alloc(size_t size);
+
+/*
+ * frees something from arena_alloc, from any thread
+*/
+void arena_free(void *ptr);
+
+/*
+ * a thread that called arena_alloc must call this before it exits, or the
+ * chunk it was allocating from is never released
+*/
+void arena_thread_done(void);
+
+/*
+ * bytes held in chunks right now and the most ever held at once
+*/
+void arena_stats(size_t *live, size_t *peak);
+#endif
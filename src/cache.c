@@ -1,11 +1,35 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "cache.h"
 #include "errorcodes.h"
 
-#define MINCACHESIZE  128
-#define MAXSTRLEN  0x400
+#define MINCACHESIZE  RBUFSIZE
 
 size_t cache_getcharnum(cache *c){
-	return c->charnum;
+	return c->base + c->pos;
+}
+
+// regular files don't need to be streamed, just map the whole thing
+static bool cache_map(cache *c) {
+	struct stat st;
+	if (fstat(c->fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0) {
+		return false;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, c->fd, 0);
+	if (map == MAP_FAILED) {
+		return false;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	c->map = (const unsigned char *) map;
+	c->map_len = st.st_size;
+
+	// nothing more to read, the window is the file
+	c->buf = c->map;
+	c->end = c->map_len;
+	c->eof = true;
+	return true;
 }
 
 cache * cache_init(size_t size, int fd){
@@ -14,110 +38,136 @@ cache * cache_init(size_t size, int fd){
 		return NULL;
 	}
 
+	c->fd = fd;
+	c->base = 0;
+	c->pos = 0;
+	c->end = 0;
+	c->mark = 0;
+	c->eof = false;
+	c->map = NULL;
+	c->map_len = 0;
+	c->mem = NULL;
+	c->size = 0;
+	if (cache_map(c)) {
+		return c;
+	}
+
 	if (size <= MINCACHESIZE) {
 		size = MINCACHESIZE;
 	}
-	c->buf = (unsigned char *) malloc(size);
-	if (!c->buf) {
+	c->mem = (unsigned char *) malloc(size);
+	if (!c->mem) {
 		free(c);
 		return NULL;
 	}
-
-	c->charnum = 0;
-	c->index = 0;
-	c->start = 0;
-	c->size = 0;
-	c->behind = 0;
-	c->real_size = size;
-	c->fd = fd;
-	c->rsize = 0;
-	c->ri = 0;
+	c->buf = c->mem;
+	c->size = size;
 	return c;
 }
 
 void cache_destroy(cache *c){
-	free(c->buf);
+	if (c->map) {
+		munmap((void *) c->map, c->map_len);
+	}
+	free(c->mem);
 	free(c);
 }
 
-static int readchr(cache *c){
-	if (c->ri == 0) {
-		if ((c->rsize = read(c->fd, c->rbuf, sizeof(c->rbuf))) <= 0) {
-			return EOF;
-		}
-	}
-	int ret = c->rbuf[c->ri++];
-	if (c->ri >= c->rsize) {
-		c->ri = 0;
-	}
-	return ret;
+size_t cache_mapped_size(cache *c) {
+	return c->map_len;
 }
 
-int cache_getc(cache *c){
-	int ret;
-	if ( c->behind ){
-		ret = c->buf[c->index];
-		c->behind--;
-		c->charnum++;
-		c->index = c->charnum%c->real_size;
-		return ret;
+void cache_view(cache *c, cache *view, size_t charnum) {
+	*view = *c;
+	view->mem = NULL;
+	view->size = 0;
+	if (charnum > view->end) {
+		charnum = view->end;
 	}
+	view->pos = charnum;
+	view->mark = charnum;
+}
+
+void cache_memory(cache *c, const char *bytes, size_t len, size_t charnum) {
+	*c = (cache) {
+		.fd = -1,
+		.buf = (const unsigned char *) bytes,
+		.base = charnum,
+		.end = len,
+		.eof = true,
+	};
+}
 
-	ret = readchr(c);
-	if (ret == EOF){
-		return ret;
+// make room at the end of mem, dropping what is before the mark
+static bool cache_make_room(cache *c) {
+	size_t keep = c->mark;
+	if (keep) {
+		memmove(c->mem, c->mem + keep, c->end - keep);
+		c->base += keep;
+		c->pos -= keep;
+		c->end -= keep;
+		c->mark = 0;
 	}
-	c->buf[c->index] = (unsigned char) ret;
-	c->charnum++;
-	c->index = c->charnum%c->real_size;
-	if ( c->size < c->real_size ) {
-		c->size++;
-		return ret;
+	if (c->end == c->size) {
+		// a single token is bigger than the buffer
+		unsigned char *tmp = (unsigned char *) realloc(c->mem, c->size * 2);
+		if (!tmp) {
+			return false;
+		}
+		c->mem = tmp;
+		c->buf = tmp;
+		c->size *= 2;
 	}
-
-	return ret;
+	return true;
 }
 
-int cache_step_back(cache *c){
-	if (c->size == 0) return ERROR;
-	if ( c->behind >= c->size ) return ERROR;
-	c->behind++;
-	c->charnum--;
-	c->index = c->charnum % c->real_size;
-	return 0;
+// read until want bytes sit in front of the current position, or input ends
+static bool cache_fill(cache *c, size_t want) {
+	while (c->end - c->pos < want && !c->eof) {
+		if (c->end == c->size && !cache_make_room(c)) {
+			return false;
+		}
+		ssize_t r = read(c->fd, c->mem + c->end, c->size - c->end);
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			c->eof = true;
+			break;
+		}
+		c->end += r;
+	}
+	return true;
 }
 
-int cache_step_backcount(cache *c, size_t count){
-	size_t i;
-	int ret;
-	// walking back one step at a time is stupid... but it avoids stupid
-	// mistakes, like skipping newlines or int underflows
-	// TODO: live dangeriously
-	for (i=0; i<count; i++){
-		ret = cache_step_back(c);
-		if ( ret < 0 ) return ret;
+const unsigned char *cache_peek(cache *c, size_t want, size_t *avail) {
+	if (c->end - c->pos < want && !cache_fill(c, want)) {
+		*avail = 0;
+		return NULL;
 	}
-	return 0;
+	*avail = c->end - c->pos;
+	return c->buf + c->pos;
 }
 
-#if 0
-int cache_str_match(cache *c, char *str){
-	int ch, test;
-	size_t i;
-	size_t max = c->real_size/2;
-	for (i=0; i<max; i++){
-		test = str[i];
-		if ( test == 0 ) return 0; // matches
-
-		ch = cache_getc(c);
-		if ( ch < EOF ) break;
-		if ( ch != test ) break;
+size_t cache_skip(cache *c, const unsigned char *table, unsigned char mask) {
+	size_t start = cache_getcharnum(c);
+	for (;;) {
+		const unsigned char *buf = c->buf;
+		size_t i = c->pos;
+		size_t end = c->end;
+		while (i < end && (table[buf[i]] & mask)) {
+			i++;
+		}
+		c->pos = i;
+		if (i < end || c->eof || !cache_fill(c, 1)) {
+			break;
+		}
 	}
-	// failed to match so step back
-	if( cache_step_backcount(c, i+1) < 0)
-		return ERROR;
-	if ( i == max || ch < EOF )
-		return ERROR;
-	return 0;
+	return cache_getcharnum(c) - start;
+}
+
+const char *cache_lexeme(cache *c, size_t *len, bool *stable) {
+	*len = c->pos - c->mark;
+	*stable = c->map != NULL;
+	return (const char *) c->buf + c->mark;
 }
-#endif
@@ -1,25 +1,89 @@
+#ifndef _CACHEGUARD
+#define _CACHEGUARD 1
 #include <unistd.h>
 #include <string.h>  //strlen
 #include <stdlib.h> // malloc
+#include <stdbool.h>
 
-#define RBUFSIZE 4096
+#define RBUFSIZE 0x10000
 
+/*
+ * The input is a window of contiguous bytes. Regular files are mapped, so the
+ * window is the whole file. Anything else is read into a buffer that keeps
+ * every byte from the mark onwards, so a token being scanned is always
+ * contiguous in memory.
+*/
 typedef struct  cache {
 	int fd;
-	unsigned char *buf;
-	size_t charnum, real_size, size;
-	size_t start,index, behind;
+	const unsigned char *buf; // the window, either map or mem
+	size_t base;              // charnum of buf[0]
+	size_t pos, end, mark;    // indexes into buf
+	bool eof;
 
 	// for buffering read
-	unsigned char rbuf[RBUFSIZE];
-	size_t ri;
-	ssize_t rsize;
+	unsigned char *mem;
+	size_t size;
+
+	// regular files are mapped instead, so tokens can point straight at them
+	const unsigned char *map;
+	size_t map_len;
 } cache;
 
 
 size_t cache_getcharnum(cache *c);
 cache * cache_init(size_t size, int fd);
 void cache_destroy(cache *c);
-int cache_getc(cache *c);
-int cache_step_backcount(cache *c, size_t count);
-int cache_step_back(cache *c);
+
+// size of the mapping, 0 when the input is streamed
+size_t cache_mapped_size(cache *c);
+
+/*
+ * sets up view as another cursor into c's mapping, starting at charnum. A view
+ * owns nothing, it is never passed to cache_destroy and must not outlive c.
+ * Only for mapped input.
+*/
+void cache_view(cache *c, cache *view, size_t charnum);
+
+/*
+ * sets c up to read the len bytes at bytes, counting chars from charnum. Like
+ * a view it owns nothing and is never passed to cache_destroy, bytes must
+ * outlive it.
+*/
+void cache_memory(cache *c, const char *bytes, size_t len, size_t charnum);
+
+/*
+ * returns a pointer to the bytes at the current position. At least want bytes
+ * are available unless the input ends first, *avail is set to the number of
+ * contiguous bytes behind the pointer. Returns NULL if memory ran out.
+ *
+ * The pointer is only good until the next peek or skip.
+*/
+const unsigned char *cache_peek(cache *c, size_t want, size_t *avail);
+
+// move the current position forward n bytes, n must have been peeked
+static inline void cache_consume(cache *c, size_t n) {
+	c->pos += n;
+}
+
+/*
+ * skip bytes while table[byte] & mask, returns the number of bytes skipped
+*/
+size_t cache_skip(cache *c, const unsigned char *table, unsigned char mask);
+
+// everything from the mark on stays in memory until the mark is moved
+static inline void cache_mark(cache *c) {
+	c->mark = c->pos;
+}
+
+static inline void cache_rewind(cache *c) {
+	c->pos = c->mark;
+}
+
+/*
+ * the bytes from the mark up to the current position. Mapped input returns a
+ * pointer into the mapping, valid until cache_destroy, and sets *stable.
+ * Otherwise the pointer is into the window and only good until the next
+ * cache_peek, the caller has to copy it.
+*/
+const char *cache_lexeme(cache *c, size_t *len, bool *stable);
+#endif
@@ -0,0 +1,575 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include "channel.h"
+#ifdef __SANITIZE_THREAD__
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#define CHANNEL_SPINS 128 // pauses before a hybrid wait parks
+#define STAGE_STACK   (8 << 20) // same as a default pthread stack, only touched pages cost
+
+// what a pool task is up to, see task_wait
+typedef enum {
+	TASK_RUNNING,
+	TASK_YIELDING, // waits, but is still on its worker's way out
+	TASK_WAITING,  // off its worker, a wake queues it
+	TASK_WOKEN,    // woken while yielding, its worker queues it
+	TASK_QUEUED,
+} Task_state;
+
+// a fused producer, or a pool task
+typedef struct channel_stage {
+	ucontext_t ctx;  // where the stage left off
+	ucontext_t back; // where whoever resumed it left off
+	struct channel_stage *resumer;
+	void *(*fn)(void *);
+	void *arg;
+	void *stack;
+	bool done;
+	// pool tasks only
+	struct channel_stage *next; // in the run queue
+	atomic_int state;
+	atomic_bool exited; // off its worker for good, may be freed
+#ifdef __SANITIZE_THREAD__
+	void *fiber, *back_fiber; // tsan can't follow swapcontext on its own
+#endif
+} Channel_stage;
+
+/*
+ * The pool's run queue. Workers take tasks off the front and run them until
+ * they wait on a channel or are done, a task whose wait is over goes on the
+ * back.
+*/
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	Channel_stage *head, *tail;
+	bool stop;
+} pool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, false };
+
+static Channel_wait wait_mode = CHANNEL_WAIT_HYBRID;
+static atomic_size_t parks;
+static atomic_size_t throttles;
+static atomic_size_t handoffs, handoff_items;
+static size_t budget;
+static bool fused;
+static bool pooled;
+static Channel_stage *running; // NULL on the thread's own stack
+static __thread Channel_stage *task_running; // the pool task on this worker
+static atomic_size_t task_waits;
+
+void channel_set_wait(Channel_wait mode) {
+	wait_mode = mode;
+}
+
+void channel_set_fused(bool on) {
+	fused = on;
+}
+
+void channel_set_pool(bool on) {
+	pooled = on;
+}
+
+void channel_set_budget(size_t bytes) {
+	budget = bytes;
+}
+
+size_t channel_budget(void) {
+	return budget;
+}
+
+size_t channel_capacity(size_t item_size, size_t fallback) {
+	if (!budget) {
+		return fallback;
+	}
+	size_t n = budget / item_size;
+	return n < 2 ? 2 : n;
+}
+
+// into s from whoever runs now, and back out of it
+static inline void switch_in(Channel_stage *s) {
+#ifdef __SANITIZE_THREAD__
+	s->back_fiber = __tsan_get_current_fiber();
+	__tsan_switch_to_fiber(s->fiber, 0);
+#endif
+	swapcontext(&s->back, &s->ctx);
+}
+
+static inline void switch_out(Channel_stage *s) {
+#ifdef __SANITIZE_THREAD__
+	__tsan_switch_to_fiber(s->back_fiber, 0);
+#endif
+	swapcontext(&s->ctx, &s->back);
+}
+
+static void stage_yield(void) {
+	switch_out(running);
+}
+
+static void stage_entry(void) {
+	running->fn(running->arg);
+	running->done = true;
+	stage_yield(); // for good
+}
+
+// runs s until it waits on a full channel or is done
+static void stage_resume(Channel_stage *s) {
+	if (s->done) {
+		return;
+	}
+	s->resumer = running;
+	running = s;
+	switch_in(s);
+	running = s->resumer;
+}
+
+static Channel_stage *stage_new(void *(*fn)(void *), void *arg, void (*entry)(void)) {
+	Channel_stage *s = (Channel_stage *) malloc(sizeof(Channel_stage));
+	if (!s) {
+		return NULL;
+	}
+	s->stack = mmap(NULL, STAGE_STACK, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (s->stack == MAP_FAILED || getcontext(&s->ctx) != 0) {
+		if (s->stack != MAP_FAILED) {
+			munmap(s->stack, STAGE_STACK);
+		}
+		free(s);
+		return NULL;
+	}
+	s->ctx.uc_stack.ss_sp = s->stack;
+	s->ctx.uc_stack.ss_size = STAGE_STACK;
+	s->ctx.uc_link = NULL;
+	makecontext(&s->ctx, entry, 0);
+	s->fn = fn;
+	s->arg = arg;
+	s->done = false;
+	s->next = NULL;
+	atomic_init(&s->state, TASK_QUEUED);
+	atomic_init(&s->exited, false);
+#ifdef __SANITIZE_THREAD__
+	s->fiber = __tsan_create_fiber(0);
+#endif
+	return s;
+}
+
+static void stage_free(Channel_stage *s) {
+#ifdef __SANITIZE_THREAD__
+	__tsan_destroy_fiber(s->fiber);
+#endif
+	munmap(s->stack, STAGE_STACK);
+	free(s);
+}
+
+static void pool_push(Channel_stage *s) {
+	pthread_mutex_lock(&pool.lock);
+	s->next = NULL;
+	if (pool.tail) {
+		pool.tail->next = s;
+	} else {
+		pool.head = s;
+	}
+	pool.tail = s;
+	pthread_cond_signal(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+static void task_entry(void) {
+	Channel_stage *s = task_running;
+	s->fn(s->arg);
+	s->done = true;
+	// back to whichever worker runs it now
+	switch_out(s);
+}
+
+void channel_pool_work(void) {
+	for (;;) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.head && !pool.stop) {
+			pthread_cond_wait(&pool.work, &pool.lock);
+		}
+		Channel_stage *s = pool.head;
+		if (!s) {
+			pthread_mutex_unlock(&pool.lock);
+			return;
+		}
+		if ((pool.head = s->next) == NULL) {
+			pool.tail = NULL;
+		}
+		pthread_mutex_unlock(&pool.lock);
+
+		atomic_store_explicit(&s->state, TASK_RUNNING, memory_order_relaxed);
+		task_running = s;
+		switch_in(s);
+		task_running = NULL;
+		if (s->done) {
+			atomic_store_explicit(&s->exited, true, memory_order_release);
+			continue;
+		}
+		// it is off this stack now, queue it if it was woken on the way
+		int state = TASK_YIELDING;
+		if (!atomic_compare_exchange_strong(&s->state, &state, TASK_WAITING)) {
+			atomic_store(&s->state, TASK_QUEUED);
+			pool_push(s);
+		}
+	}
+}
+
+void channel_pool_stop(void) {
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.work);
+	pthread_mutex_unlock(&pool.lock);
+}
+
+// the task waiting on the side of c that parks on parked
+static inline _Atomic(Channel_stage *) *task_slot(Channel *c, atomic_bool *parked) {
+	return parked == &c->producer_parked ? &c->producer_task : &c->consumer_task;
+}
+
+/*
+ * a pool task's wait: it goes back to its worker, which runs other tasks,
+ * until the other side changes the channel and queues it again. It says
+ * so in its slot before it looks at the channel one last time, and the
+ * other side looks at the slot after the change, like a parked thread.
+ * The slot is cleared under the channel's lock, so a wake never sees a
+ * task that went on, or away.
+*/
+static void task_wait(Channel *c, atomic_bool *parked, bool (*ready)(Channel *)) {
+	Channel_stage *s = task_running;
+	_Atomic(Channel_stage *) *slot = task_slot(c, parked);
+	atomic_store(&s->state, TASK_YIELDING);
+	atomic_store(slot, s);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!ready(c)) {
+		atomic_fetch_add_explicit(&task_waits, 1, memory_order_relaxed);
+		switch_out(s);
+	}
+	pthread_mutex_lock(&c->lock);
+	atomic_store_explicit(slot, NULL, memory_order_relaxed);
+	pthread_mutex_unlock(&c->lock);
+	atomic_store_explicit(&s->state, TASK_RUNNING, memory_order_relaxed);
+}
+
+static void task_wake(Channel *c, atomic_bool *parked) {
+	_Atomic(Channel_stage *) *slot = task_slot(c, parked);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!atomic_load_explicit(slot, memory_order_relaxed)) {
+		return;
+	}
+	pthread_mutex_lock(&c->lock);
+	// pairs with the task's store, whatever it did before waiting is seen
+	Channel_stage *s = atomic_load_explicit(slot, memory_order_acquire);
+	int state = TASK_WAITING;
+	if (s && !atomic_compare_exchange_strong(&s->state, &state, TASK_QUEUED)) {
+		// still on its way out, or already going again
+		state = TASK_YIELDING;
+		atomic_compare_exchange_strong(&s->state, &state, TASK_WOKEN);
+		s = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+	if (s) {
+		pool_push(s);
+	}
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline List_status channel_status(Channel *c) {
+	return atomic_load_explicit(&c->status, memory_order_acquire);
+}
+
+static inline size_t channel_head(Channel *c) {
+	return atomic_load_explicit(&c->head, memory_order_acquire);
+}
+
+static inline size_t channel_tail(Channel *c) {
+	return atomic_load_explicit(&c->tail, memory_order_acquire);
+}
+
+// what each side waits for
+static bool producer_ready(Channel *c) {
+	return channel_tail(c) - channel_head(c) < c->cap
+		|| LIST_IS_HALT_PRODUCER(channel_status(c));
+}
+
+static bool consumer_ready(Channel *c) {
+	return channel_tail(c) != channel_head(c)
+		|| channel_status(c) & (LIST_PRODUCER_FIN | LIST_HALT_CONSUMER);
+}
+
+static bool destroy_ready(Channel *c) {
+	return channel_tail(c) != channel_head(c)
+		|| LIST_IS_PRODUCER_FIN(channel_status(c));
+}
+
+/*
+ * one round of waiting for the other side. A parked thread says so in parked
+ * before it looks at the channel one last time, and whoever changes the
+ * channel looks at parked after the change, so one of them always sees the
+ * other.
+*/
+static void channel_wait(Channel *c, unsigned int *spins, atomic_bool *parked, bool (*ready)(Channel *)) {
+	if (task_running) {
+		task_wait(c, parked, ready);
+		return;
+	}
+	if (c->stage) {
+		// the other side is on this thread, let it run
+		if (c->stage == running) {
+			stage_yield();
+		} else {
+			stage_resume(c->stage);
+		}
+		return;
+	}
+	switch (wait_mode) {
+	case CHANNEL_WAIT_SPIN:
+		cpu_relax();
+		return;
+	case CHANNEL_WAIT_HYBRID:
+		if (++*spins < CHANNEL_SPINS) {
+			cpu_relax();
+			return;
+		}
+		break;
+	case CHANNEL_WAIT_PARK:
+		break;
+	}
+	pthread_mutex_lock(&c->lock);
+	atomic_store(parked, true);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (!ready(c)) {
+		atomic_fetch_add_explicit(&parks, 1, memory_order_relaxed);
+		pthread_cond_wait(&c->wake, &c->lock);
+	}
+	atomic_store_explicit(parked, false, memory_order_relaxed);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static inline void channel_wake(Channel *c, atomic_bool *parked) {
+	if (pooled) {
+		task_wake(c, parked);
+	}
+	if (wait_mode == CHANNEL_WAIT_SPIN) {
+		return;
+	}
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(parked, memory_order_relaxed)) {
+		pthread_mutex_lock(&c->lock);
+		pthread_cond_broadcast(&c->wake);
+		pthread_mutex_unlock(&c->lock);
+	}
+}
+
+Channel *channel_new(void (*destructor)(void *ptr), size_t capacity) {
+	if (!destructor) {
+		return NULL;
+	}
+	if (capacity < 1) {
+		capacity = 1;
+	}
+	size_t size = 2;
+	while (size < capacity) {
+		size *= 2;
+	}
+	Channel *c = (Channel *) aligned_alloc(CHANNEL_LINE, (sizeof(Channel) + CHANNEL_LINE - 1) & ~(size_t) (CHANNEL_LINE - 1));
+	if (!c) {
+		return NULL;
+	}
+	if ((c->slots = (void **) malloc(size * sizeof(void *))) == NULL) {
+		free(c);
+		return NULL;
+	}
+	atomic_init(&c->head, 0);
+	atomic_init(&c->tail, 0);
+	atomic_init(&c->items, 0);
+	atomic_init(&c->status, 0);
+	atomic_init(&c->producer_parked, false);
+	atomic_init(&c->consumer_parked, false);
+	atomic_init(&c->producer_task, NULL);
+	atomic_init(&c->consumer_task, NULL);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->wake, NULL);
+	c->tail_cache = c->head_cache = 0;
+	c->cap = capacity;
+	c->mask = size - 1;
+	c->free = destructor;
+	c->stage = NULL;
+	c->task = NULL;
+	c->started = false;
+	return c;
+}
+
+bool channel_start_thread(Channel *c, void *(*fn)(void *), void *arg) {
+	if (fused) {
+		if ((c->stage = stage_new(fn, arg, stage_entry)) == NULL) {
+			return false;
+		}
+	} else if (pooled) {
+		if ((c->task = stage_new(fn, arg, task_entry)) == NULL) {
+			return false;
+		}
+		pool_push(c->task);
+	} else if (pthread_create(&c->tid, NULL, fn, arg) != 0) {
+		return false;
+	}
+	c->started = true;
+	return true;
+}
+
+bool channel_push_block(Channel *c, void *data) {
+	return channel_push_batch(c, data, 1);
+}
+
+bool channel_push_batch(Channel *c, void *data, size_t items) {
+	if (!data) {
+		return false;
+	}
+	size_t tail = atomic_load_explicit(&c->tail, memory_order_relaxed);
+	unsigned int spins = 0;
+	bool throttled = false; // counted once per push, whatever the wait mode
+	while (tail - c->head_cache >= c->cap) {
+		c->head_cache = channel_head(c);
+		if (tail - c->head_cache < c->cap) {
+			break;
+		}
+		if (!throttled) {
+			throttled = true;
+			atomic_fetch_add_explicit(&throttles, 1, memory_order_relaxed);
+		}
+		if (LIST_IS_HALT_PRODUCER(channel_status(c))) {
+			c->free(data);
+			return false;
+		}
+		channel_wait(c, &spins, &c->producer_parked, producer_ready);
+	}
+	if (LIST_IS_HALT_PRODUCER(channel_status(c))) {
+		c->free(data);
+		return false;
+	}
+	c->slots[tail & c->mask] = data;
+	// only the producer writes it, no need for an atomic add
+	atomic_store_explicit(&c->items, atomic_load_explicit(&c->items, memory_order_relaxed) + items, memory_order_relaxed);
+	atomic_store_explicit(&c->tail, tail + 1, memory_order_release);
+	channel_wake(c, &c->consumer_parked);
+	return true;
+}
+
+void channel_producer_fin(Channel *c) {
+	channel_status_set_flag(c, LIST_PRODUCER_FIN);
+}
+
+void *channel_peek_block(Channel *c) {
+	size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	unsigned int spins = 0;
+	while (head == c->tail_cache) {
+		c->tail_cache = channel_tail(c);
+		if (head != c->tail_cache) {
+			break;
+		}
+		List_status s = channel_status(c);
+		if (LIST_IS_HALT_CONSUMER(s)) {
+			return NULL;
+		}
+		if (LIST_IS_PRODUCER_FIN(s)) {
+			// fin is set after the last push, look once more
+			c->tail_cache = channel_tail(c);
+			if (head == c->tail_cache) {
+				return NULL;
+			}
+			break;
+		}
+		channel_wait(c, &spins, &c->consumer_parked, consumer_ready);
+	}
+	return c->slots[head & c->mask];
+}
+
+static inline void channel_advance(Channel *c) {
+	size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	atomic_store_explicit(&c->head, head + 1, memory_order_release);
+	channel_wake(c, &c->producer_parked);
+}
+
+void channel_drop_head(Channel *c) {
+	size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	void *data = c->slots[head & c->mask];
+	channel_advance(c);
+	c->free(data);
+}
+
+void *channel_pop_block(Channel *c) {
+	void *data = channel_peek_block(c);
+	if (data) {
+		channel_advance(c);
+	}
+	return data;
+}
+
+List_status channel_status_set_flag(Channel *c, List_status s) {
+	s |= atomic_fetch_or_explicit(&c->status, s, memory_order_acq_rel);
+	channel_wake(c, &c->producer_parked);
+	channel_wake(c, &c->consumer_parked);
+	return s;
+}
+
+size_t channel_parks(void) {
+	return atomic_load_explicit(&parks, memory_order_relaxed);
+}
+
+size_t channel_task_waits(void) {
+	return atomic_load_explicit(&task_waits, memory_order_relaxed);
+}
+
+size_t channel_throttles(void) {
+	return atomic_load_explicit(&throttles, memory_order_relaxed);
+}
+
+void channel_handoffs(size_t *pushes, size_t *items) {
+	*pushes = atomic_load_explicit(&handoffs, memory_order_relaxed);
+	*items = atomic_load_explicit(&handoff_items, memory_order_relaxed);
+}
+
+void channel_destroy(Channel *c) {
+	if (!c) {
+		return;
+	}
+	channel_status_set_flag(c, LIST_HALT_PRODUCER);
+	unsigned int spins = 0;
+	// keep making room until the producer notices
+	while (c->started && !LIST_IS_PRODUCER_FIN(channel_status(c))) {
+		if (atomic_load_explicit(&c->head, memory_order_relaxed) != channel_tail(c)) {
+			channel_drop_head(c);
+		} else {
+			channel_wait(c, &spins, &c->consumer_parked, destroy_ready);
+		}
+	}
+	if (c->stage) {
+		stage_free(c->stage);
+	} else if (c->task) {
+		// fin is its last word, it is gone from its worker right after
+		while (!atomic_load_explicit(&c->task->exited, memory_order_acquire)) {
+			sched_yield();
+		}
+		stage_free(c->task);
+	} else if (c->started) {
+		pthread_join(c->tid, NULL);
+	}
+	size_t head = atomic_load_explicit(&c->head, memory_order_relaxed);
+	size_t tail = channel_tail(c);
+	atomic_fetch_add_explicit(&handoffs, tail, memory_order_relaxed);
+	atomic_fetch_add_explicit(&handoff_items, atomic_load_explicit(&c->items, memory_order_relaxed), memory_order_relaxed);
+	for (; head != tail; head++) {
+		c->free(c->slots[head & c->mask]);
+	}
+	pthread_cond_destroy(&c->wake);
+	pthread_mutex_destroy(&c->lock);
+	free(c->slots);
+	free(c);
+}
@@ -0,0 +1,155 @@
+#ifndef _CHANNELGUARD
+#define _CHANNELGUARD 1
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "list.h" // List_status and its flags
+
+/*
+ * Bounded queue between two pipeline stages, exactly one thread pushes and
+ * one pops. It is a ring of pointers with free running head and tail
+ * indexes, no locks and no allocation per item. The two indexes live on
+ * cache lines of their own, and each side keeps a stale copy of the other's
+ * so it only has to look at the shared one when the ring seems full or empty.
+ *
+ * Status uses the List_status flags.
+*/
+#define CHANNEL_LINE 64
+
+/*
+ * how a side waits for the other. Spinning reacts fastest but keeps a core
+ * busy for as long as the wait lasts, parking sleeps on a condition variable
+ * until the other side signals. Hybrid spins a little, then parks.
+*/
+typedef enum {
+	CHANNEL_WAIT_SPIN,
+	CHANNEL_WAIT_HYBRID,
+	CHANNEL_WAIT_PARK,
+} Channel_wait;
+
+typedef struct channel {
+	// written by the consumer
+	_Alignas(CHANNEL_LINE) atomic_size_t head;
+	size_t tail_cache;
+
+	// written by the producer
+	_Alignas(CHANNEL_LINE) atomic_size_t tail;
+	size_t head_cache;
+	atomic_size_t items; // over all pushes, read for stats once the producer is done
+
+	_Alignas(CHANNEL_LINE) atomic_uchar status;
+	atomic_bool producer_parked, consumer_parked;
+	pthread_mutex_t lock; // only for parking
+	pthread_cond_t wake;
+	size_t cap;  // items it takes to be full
+	size_t mask; // ring size - 1, the ring is cap rounded up to a power of two
+	void **slots;
+	void (*free)(void *ptr);
+
+	// the thread that produces into the channel, joined on destroy
+	pthread_t tid;
+	struct channel_stage *stage; // instead of tid when fused
+	struct channel_stage *task;  // instead of tid when pooled
+	// pool tasks waiting on either side
+	_Atomic(struct channel_stage *) producer_task, consumer_task;
+	bool started;
+} Channel;
+
+// for every channel, set before any thread starts
+void channel_set_wait(Channel_wait mode);
+
+// how many times a wait parked, over all channels
+size_t channel_parks(void);
+
+/*
+ * fused runs every producer started after this as a coroutine on the
+ * consumer's thread instead of a thread of its own. A consumer that finds
+ * its channel empty runs the producer until the channel is full or the
+ * producer is done, a producer that finds it full goes back to the consumer.
+ * The whole pipeline then runs on one thread with no locks, spinning or
+ * thread startup.
+*/
+void channel_set_fused(bool fused);
+
+/*
+ * pooled runs every producer started after this as a task on a shared pool
+ * of worker threads, each thread calls channel_pool_work. A task runs until
+ * it has to wait on a channel, then its worker goes on with another one,
+ * and the other side of the channel queues it again once it may go on.
+*/
+void channel_set_pool(bool pooled);
+
+// runs pool tasks until channel_pool_stop, on each thread of the pool
+void channel_pool_work(void);
+
+// workers return once the run queue is empty, call when every task is done
+void channel_pool_stop(void);
+
+// how many times a pool task waited and gave its worker up
+size_t channel_task_waits(void);
+
+/*
+ * bytes the queue between two stages may hold, 0 leaves every queue at its
+ * built in size. Set before any channel is made.
+*/
+void channel_set_budget(size_t bytes);
+size_t channel_budget(void);
+
+/*
+ * how many items of about item_size bytes fit the budget, fallback when
+ * there is none
+*/
+size_t channel_capacity(size_t item_size, size_t fallback);
+
+// how many pushes found their channel full and had to wait, over all channels
+size_t channel_throttles(void);
+
+/*
+ * pushes and the items they carried, over all destroyed channels. Each push
+ * is one hand-off between threads, however many items it carries.
+*/
+void channel_handoffs(size_t *pushes, size_t *items);
+
+/*
+ * holds up to capacity items, destructor frees items that are dropped
+*/
+Channel *channel_new(void (*destructor)(void *ptr), size_t capacity);
+
+/*
+ * runs fn(arg) in the channel's producer thread, or coroutine when fused
+*/
+bool channel_start_thread(Channel *c, void *(*fn)(void *), void *arg);
+
+/*
+ * producer side. Blocks while the channel is full, returns false and frees
+ * data if the consumer went away.
+*/
+bool channel_push_block(Channel *c, void *data);
+
+// same, data is a batch of items, only counted for stats
+bool channel_push_batch(Channel *c, void *data, size_t items);
+
+// producer is done, nothing more will be pushed
+void channel_producer_fin(Channel *c);
+
+/*
+ * consumer side. Blocks until there is an item, NULL when the producer is
+ * done and everything was taken or the consumer was told to halt.
+*/
+void *channel_pop_block(Channel *c);
+
+// like channel_pop_block, but leaves the item in the channel
+void *channel_peek_block(Channel *c);
+
+// frees the head item, it must have been peeked
+void channel_drop_head(Channel *c);
+
+List_status channel_status_set_flag(Channel *c, List_status s);
+
+/*
+ * consumer is done with the channel, tells the producer to stop, waits for
+ * its thread and frees whatever is left
+*/
+void channel_destroy(Channel *c);
+#endif
@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "decode_cache.h"
+
+#define DECODE_CACHE_ENTRY_AVG 256 // bytes an entry is guessed to take, sizes the table
+
+struct decode_entry {
+	struct decode_entry *next;   // in its bucket
+	struct decode_entry *newer;  // use order, most recent at the head
+	struct decode_entry *older;
+	uint64_t hash;
+	size_t key_len;
+	size_t value_len;
+	size_t refs;
+	bool same;    // decodes to itself, no value
+	bool evicted; // out of the table, freed on the last release
+	char bytes[]; // key, then value
+};
+
+struct decode_cache {
+	pthread_mutex_t lock;
+	Decode_entry **buckets;
+	size_t mask;
+	Decode_entry *newest, *oldest;
+	size_t bytes, max_bytes;
+	size_t hits, misses, evictions;
+};
+
+static inline size_t entry_size(const Decode_entry *e) {
+	return sizeof(Decode_entry) + e->key_len + e->value_len;
+}
+
+Decode_cache *decode_cache_new(size_t max_bytes) {
+	Decode_cache *c = (Decode_cache *) calloc(1, sizeof(Decode_cache));
+	if (!c) {
+		return NULL;
+	}
+	size_t n = 64;
+	while (n < max_bytes / DECODE_CACHE_ENTRY_AVG) {
+		n *= 2;
+	}
+	if ((c->buckets = (Decode_entry **) calloc(n, sizeof(Decode_entry *))) == NULL) {
+		free(c);
+		return NULL;
+	}
+	c->mask = n - 1;
+	c->max_bytes = max_bytes;
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+}
+
+void decode_cache_destroy(Decode_cache *c) {
+	if (!c) {
+		return;
+	}
+	Decode_entry *e = c->newest;
+	while (e) {
+		Decode_entry *older = e->older;
+		free(e);
+		e = older;
+	}
+	pthread_mutex_destroy(&c->lock);
+	free(c->buckets);
+	free(c);
+}
+
+// FNV-1a style, a word at a time since keys are long
+uint64_t decode_cache_hash(const char *key, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL ^ len;
+	size_t i = 0;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t w;
+		memcpy(&w, key + i, 8);
+		h = (h ^ w) * 0x100000001b3ULL;
+		h ^= h >> 29;
+	}
+	for (; i < len; i++) {
+		h = (h ^ (unsigned char) key[i]) * 0x100000001b3ULL;
+	}
+	return h ^ h >> 32;
+}
+
+static void lru_unlink(Decode_cache *c, Decode_entry *e) {
+	if (e->newer) {
+		e->newer->older = e->older;
+	} else {
+		c->newest = e->older;
+	}
+	if (e->older) {
+		e->older->newer = e->newer;
+	} else {
+		c->oldest = e->newer;
+	}
+	e->newer = e->older = NULL;
+}
+
+static void lru_push(Decode_cache *c, Decode_entry *e) {
+	e->older = c->newest;
+	e->newer = NULL;
+	if (c->newest) {
+		c->newest->newer = e;
+	} else {
+		c->oldest = e;
+	}
+	c->newest = e;
+}
+
+static Decode_entry *lookup(Decode_cache *c, const char *key, size_t len, uint64_t hash) {
+	Decode_entry *e;
+	for (e = c->buckets[hash & c->mask]; e; e = e->next) {
+		if (e->hash == hash && e->key_len == len && memcmp(e->bytes, key, len) == 0) {
+			break;
+		}
+	}
+	return e;
+}
+
+static void table_unlink(Decode_cache *c, Decode_entry *e) {
+	Decode_entry **p = &c->buckets[e->hash & c->mask];
+	while (*p != e) {
+		p = &(*p)->next;
+	}
+	*p = e->next;
+}
+
+// drops the oldest entries until there is room, entries in use are freed when released
+static void evict(Decode_cache *c) {
+	while (c->bytes > c->max_bytes && c->oldest) {
+		Decode_entry *e = c->oldest;
+		table_unlink(c, e);
+		lru_unlink(c, e);
+		c->bytes -= entry_size(e);
+		c->evictions++;
+		if (e->refs) {
+			e->evicted = true;
+		} else {
+			free(e);
+		}
+	}
+}
+
+Decode_entry *decode_cache_get(Decode_cache *c, const char *key, size_t len, uint64_t hash) {
+	pthread_mutex_lock(&c->lock);
+	Decode_entry *e = lookup(c, key, len, hash);
+	if (e) {
+		c->hits++;
+		e->refs++;
+		lru_unlink(c, e);
+		lru_push(c, e);
+	} else {
+		c->misses++;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+Decode_entry *decode_cache_put(Decode_cache *c, const char *key, size_t len, uint64_t hash,
+	const char *value, size_t value_len) {
+	if (!value) {
+		value_len = 0;
+	}
+	Decode_entry *e = (Decode_entry *) malloc(sizeof(Decode_entry) + len + value_len);
+	if (!e) {
+		return NULL;
+	}
+	e->hash = hash;
+	e->key_len = len;
+	e->value_len = value_len;
+	e->same = !value;
+	e->evicted = false;
+	e->refs = 1;
+	memcpy(e->bytes, key, len);
+	if (value) {
+		memcpy(e->bytes + len, value, value_len);
+	}
+
+	pthread_mutex_lock(&c->lock);
+	Decode_entry *had = lookup(c, key, len, hash);
+	if (had) {
+		had->refs++;
+		pthread_mutex_unlock(&c->lock);
+		free(e);
+		return had;
+	}
+	Decode_entry **bucket = &c->buckets[hash & c->mask];
+	e->next = *bucket;
+	*bucket = e;
+	lru_push(c, e);
+	c->bytes += entry_size(e);
+	evict(c);
+	pthread_mutex_unlock(&c->lock);
+	return e;
+}
+
+void decode_cache_release(Decode_cache *c, Decode_entry *e) {
+	pthread_mutex_lock(&c->lock);
+	bool gone = --e->refs == 0 && e->evicted;
+	pthread_mutex_unlock(&c->lock);
+	if (gone) {
+		free(e);
+	}
+}
+
+const char *decode_entry_value(const Decode_entry *e, size_t *len) {
+	if (e->same) {
+		return NULL;
+	}
+	*len = e->value_len;
+	return e->bytes + e->key_len;
+}
+
+void decode_cache_stats(Decode_cache *c, size_t *hits, size_t *misses, size_t *evictions, size_t *bytes) {
+	pthread_mutex_lock(&c->lock);
+	*hits = c->hits;
+	*misses = c->misses;
+	*evictions = c->evictions;
+	*bytes = c->bytes;
+	pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,37 @@
+#ifndef _DECODECACHEGUARD
+#define _DECODECACHEGUARD 1
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * What string lexemes decode to, keyed on the lexeme's bytes. Bounded to
+ * max_bytes, the least recently used entries go first. Any thread may use
+ * it, entries handed out are counted and stay valid until released, even
+ * if they are evicted meanwhile.
+*/
+typedef struct decode_cache Decode_cache;
+typedef struct decode_entry Decode_entry;
+
+Decode_cache *decode_cache_new(size_t max_bytes);
+void decode_cache_destroy(Decode_cache *c);
+
+uint64_t decode_cache_hash(const char *key, size_t len);
+
+// the entry for key with a reference taken, NULL if there is none
+Decode_entry *decode_cache_get(Decode_cache *c, const char *key, size_t len, uint64_t hash);
+
+/*
+ * adds what key decodes to, value NULL if it stays as it is, and returns
+ * the entry with a reference taken. If key went in meanwhile that entry is
+ * returned instead. NULL if memory ran out.
+*/
+Decode_entry *decode_cache_put(Decode_cache *c, const char *key, size_t len, uint64_t hash,
+	const char *value, size_t value_len);
+
+void decode_cache_release(Decode_cache *c, Decode_entry *e);
+
+// what the entry's key decodes to and its length, NULL if it stays as it is
+const char *decode_entry_value(const Decode_entry *e, size_t *len);
+
+void decode_cache_stats(Decode_cache *c, size_t *hits, size_t *misses, size_t *evictions, size_t *bytes);
+#endif
@@ -1,186 +1,759 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
 #include "decoders.h"
-#include "threads.h"
+#include "stage.h"
 #include "tokenizer.h"
+#include "token_block.h"
+#include "decode_cache.h"
 
-static bool b64_buf_add_byte(char **buf, size_t *index, size_t *size, char c) {
-	if (*index >= *size) {
-		fprintf(stderr, "OVERFLOW in b64\n");
+#define B64_BAD 0x80 // b64_digit of anything that isn't a base64 digit
+
+static unsigned char b64_digit[256];
+// bytes each decoded byte takes in the '' literal, 0 for ones that rule the string out
+static unsigned char b64_width[256];
+
+static void b64_tables_init(void) {
+	const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	memset(b64_digit, B64_BAD, sizeof(b64_digit));
+	for (size_t i = 0; i < sizeof(digits) - 1; i++) {
+		b64_digit[(unsigned char) digits[i]] = i;
+	}
+	for (int c = ' '; c <= '~'; c++) {
+		b64_width[c] = 1;
+	}
+	b64_width['\t'] = 1;
+	// written as \xNN
+	b64_width['\n'] = b64_width['"'] = b64_width['\''] = b64_width['\\'] = 4;
+}
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i in_range(__m128i v, char lo, char hi) {
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+// all 16 bytes at s are base64 digits
+static inline bool b64_digits16(const char *s) {
+	__m128i v = _mm_loadu_si128((const __m128i *) s);
+	__m128i ok = _mm_or_si128(_mm_or_si128(in_range(v, 'A', 'Z'), in_range(v, 'a', 'z')),
+		_mm_or_si128(in_range(v, '0', '9'), _mm_or_si128(
+			_mm_cmpeq_epi8(v, _mm_set1_epi8('+')), _mm_cmpeq_epi8(v, _mm_set1_epi8('/')))));
+	return _mm_movemask_epi8(ok) == 0xffff;
+}
+#endif
+
+/*
+ * cheap test run on every string before anything is decoded or allocated:
+ * whole quads of base64 digits, with up to two '=' of padding at the end
+*/
+static bool b64_plausible(const char *s, size_t len) {
+	if (len < 4 || len % 4) {
 		return false;
 	}
-	if (c == '"') { // must encode it so it can be put in "" later
-		const char input[] = "\\x22";
-		const size_t ilen = sizeof(input) - 1;
-		*size += ilen - 1; // -1 for null, -1 for space already allocated for char
-		if ((*buf = realloc(*buf, *size)) == NULL) {
+	size_t pad = s[len - 1] == '=' ? (s[len - 2] == '=' ? 2 : 1) : 0;
+	size_t body = len - pad;
+	size_t i = 0;
+#if defined(__SSE2__)
+	for (; i + 16 <= body; i += 16) {
+		if (!b64_digits16(s + i)) {
 			return false;
 		}
-		memcpy(*buf + *index, input, ilen);
-		*index += ilen;
-		return true;
 	}
-
-	// ascii check
-	if (c != '\t' && c != '\n' && (c > '~' || c < ' ' )) {
-		return false;
+#endif
+	unsigned char bad = 0;
+	for (; i < body; i++) {
+		bad |= b64_digit[(unsigned char) s[i]];
 	}
-	*buf[(*index)++] = c;
-	return true;
+	return !(bad & B64_BAD);
 }
 
-static char * decode_b64(const char *b64, size_t b64_len, size_t *bufsize) {
-	if (b64_len < 4) {
-		return NULL;
+/*
+ * decodes a plausible string a quad at a time. Returns the bytes the decoded
+ * text takes in a '' literal, writing it to out unless that is NULL, or 0 if
+ * it decodes to something other than printable text.
+*/
+static size_t b64_walk(const char *s, size_t len, char *out) {
+	static const char hex[] = "0123456789abcdef";
+	size_t pad = s[len - 1] == '=' ? (s[len - 2] == '=' ? 2 : 1) : 0;
+	unsigned char last[4];
+	memcpy(last, s + len - 4, 4);
+	for (size_t k = 4 - pad; k < 4; k++) {
+		last[k] = 'A';
 	}
-	{
-		size_t bitsize = b64_len * 6;
-		if (b64[b64_len - 1] == '=') {
-			if (b64[b64_len - 2] == '=') {
-				bitsize -= 16;
-				b64_len -= 2;
-			} else {
-				bitsize -= 8;
-				b64_len -= 1;
+
+	size_t off = 0;
+	for (size_t i = 0; i < len; i += 4) {
+		const unsigned char *q = i + 4 < len ? (const unsigned char *) s + i : last;
+		uint32_t v = (uint32_t) b64_digit[q[0]] << 18 | (uint32_t) b64_digit[q[1]] << 12
+			| (uint32_t) b64_digit[q[2]] << 6 | b64_digit[q[3]];
+		unsigned char bytes[3] = { v >> 16, v >> 8, v };
+		size_t n = i + 4 < len ? 3 : 3 - pad;
+		// btoa only gives the string back if the bits under the padding are 0
+		for (size_t k = n; k < 3; k++) {
+			if (bytes[k]) {
+				return 0;
 			}
 		}
-		if (bitsize % 8 != 0) {
-			return NULL;
+		for (size_t k = 0; k < n; k++) {
+			unsigned char c = bytes[k];
+			switch (b64_width[c]) {
+			case 0:
+				return 0;
+			case 1:
+				if (out) {
+					out[off] = c;
+				}
+				off++;
+				break;
+			default:
+				if (out) {
+					out[off] = '\\';
+					out[off + 1] = 'x';
+					out[off + 2] = hex[c >> 4];
+					out[off + 3] = hex[c & 0xf];
+				}
+				off += 4;
+				break;
+			}
 		}
-		*bufsize = (bitsize / 8) + 1;
 	}
+	return off;
+}
 
-	char *buf = (char *) malloc(*bufsize);
-
+/*
+ * btoa('...') for a base64 string, in a buffer of just the right size. NULL
+ * if it doesn't decode to text.
+*/
+static char *b64_literal(const char *s, size_t len, size_t *outlen) {
+	const char start[] = "btoa('";
+	const char end[] = "')";
+	size_t n = b64_walk(s, len, NULL);
+	if (!n) {
+		return NULL;
+	}
+	*outlen = sizeof(start) - 1 + n + sizeof(end) - 1;
+	char *buf = (char *) malloc(*outlen);
 	if (!buf) {
 		return NULL;
 	}
+	memcpy(buf, start, sizeof(start) - 1);
+	b64_walk(s, len, buf + sizeof(start) - 1);
+	memcpy(buf + sizeof(start) - 1 + n, end, sizeof(end) - 1);
+	return buf;
+}
 
-	unsigned short tmp_hldr = 0;		 // hold addition 2 bytes
-	short int bits_in = 0;
-	size_t i, j=0;
-	for (i=0; i<b64_len; i++){
-		tmp_hldr <<= 6;
-		if (b64[i] >= 'A' && b64[i] <= 'Z') {
-			tmp_hldr |= b64[i] - 0x41;
-		} else if (b64[i] >= 'a' && b64[i] <= 'z') {
-			tmp_hldr |= b64[i] - 0x47; // 0x41 + 0x6 because 6 chars between z and A
-		} else if ( b64[i] >= '0' && b64[i] <= '9') {
-			tmp_hldr |= b64[i] + 0x04; // ascii('0') = 0x30 and base64('0') = 0x34, so to speak
-		} else if (b64[i] == '+') {
-			tmp_hldr |= 0x3e;
-		} else if (b64[i] == '/') {
-			tmp_hldr |= 0x3f;
-		} else {
-			free(buf);
-			return NULL;
+static inline int hex_digit(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f') {
+		return c - 'a' + 10;
+	}
+	return -1;
+}
+
+// value of digits hex digits at s, -1 if one isn't
+static inline int hex_value(const char *s, size_t digits) {
+	int v = 0;
+	for (size_t k = 0; k < digits; k++) {
+		int d = hex_digit(s[k]);
+		if (d < 0) {
+			return -1;
+		}
+		v = v << 4 | d;
+	}
+	return v;
+}
+
+/*
+ * writes a string lexeme, quotes included, to out with its \xNN and \uNNNN
+ * escapes of printable ASCII turned into the characters themselves. The
+ * string's own quote, backslashes and a template's `$` and `{` stay escaped,
+ * so the literal still means the same and no ${ is made up. Every other escape is copied as it is.
+ *
+ * Returns the new length, never more than len, or 0 if there was nothing to
+ * rewrite.
+*/
+static size_t unescape_string(const char *s, size_t len, tokentype type, char *out) {
+	char quote = s[0];
+	size_t i = 0, o = 0;
+	bool changed = false;
+	const char *p;
+	while ((p = (const char *) memchr(s + i, '\\', len - i)) != NULL) {
+		size_t at = p - s;
+		if (at + 1 >= len) {
+			break;
 		}
+		memcpy(out + o, s + i, at - i);
+		o += at - i;
 
-		bits_in += 6;
-		if (bits_in >= 8){
-			bits_in -= 8;
-			char c = tmp_hldr >> bits_in;
-			if (!b64_buf_add_byte(&buf, &j, bufsize, c)) {
-				free (buf);
-				return NULL;
-			}
+		size_t digits = s[at + 1] == 'x' ? 2 : s[at + 1] == 'u' ? 4 : 0;
+		// the closing quote can't be part of it
+		int v = digits && at + 2 + digits < len ? hex_value(s + at + 2, digits) : -1;
+		if (v >= ' ' && v <= '~' && v != quote && v != '\\'
+			&& !(type == TOKEN_TILDA_STRING && (v == '$' || v == '{'))) {
+			out[o++] = v;
+			i = at + 2 + digits;
+			changed = true;
+		} else {
+			out[o++] = '\\';
+			out[o++] = s[at + 1];
+			i = at + 2;
 		}
 	}
-	buf[*bufsize] = '\0';
-	return buf;
+	if (!changed) {
+		return 0;
+	}
+	memcpy(out + o, s + i, len - i);
+	return o + len - i;
 }
 
-static bool decode_string(Token *tok) {
-	size_t size = 0;
-	char *b64 = decode_b64(tok->value + 1, tok->length - 2, &size);
-	if (!b64) {
-		return false;
+// scratch for unescaped strings, grows to the longest one seen
+typedef struct {
+	char *buf;
+	size_t cap;
+} Scratch;
+
+static bool scratch_fit(Scratch *s, size_t len) {
+	if (len <= s->cap) {
+		return true;
 	}
-	const char start[] = "btoa('";
-	const char end[] = "')";
-	size_t alloc_size = sizeof(start) - 1 // size of start without NULL sentinal
-		+ sizeof(end) - 1 // size of end without NULL sentinal
-		+ size; // size of buffer with NULL sentinal
-	char *buf = (char *) malloc(alloc_size);
+	size_t cap = s->cap ? s->cap : 256;
+	while (cap < len) {
+		cap *= 2;
+	}
+	char *buf = (char *) realloc(s->buf, cap);
 	if (!buf) {
-		free(b64);
 		return false;
 	}
+	s->buf = buf;
+	s->cap = cap;
+	return true;
+}
 
-	free((void *) tok->value);
-	tok->value = buf;
-	tok->length = alloc_size - 1; // NULL term not included in length
+/*
+ * unescapes a string lexeme, then turns it into a btoa literal if what is
+ * left is base64. Returns what it decodes to and sets *len, or NULL when it
+ * stays as it is, memory running out included. The result is in the scratch,
+ * or a literal of its own to free when *lit is set.
+*/
+static const char *decode_lexeme(Scratch *s, const char *value, size_t *len, tokentype type, bool *lit) {
+	*lit = false;
+	if (*len < 2 || !scratch_fit(s, *len)) {
+		return NULL;
+	}
+	size_t plain = unescape_string(value, *len, type, s->buf);
+	if (plain) {
+		value = s->buf;
+		*len = plain;
+	}
 
-	memcpy(buf, start, sizeof(start) - 1);
-	size_t off = sizeof(start) - 1;
+	size_t lit_len;
+	char *b64 = *len > 2 && b64_plausible(value + 1, *len - 2)
+		? b64_literal(value + 1, *len - 2, &lit_len) : NULL;
+	if (b64) {
+		*lit = true;
+		*len = lit_len;
+		return b64;
+	}
+	return plain ? value : NULL;
+}
 
-	memcpy(buf + off, b64, size - 1);
-	off += size - 1;
-	free (b64);
+/*
+ * Bundles repeat the same long literal over and over, those are decoded once
+ * and looked up after that
+*/
+#define DECODE_CACHE_MIN   64        // shorter strings decode about as fast as they hash
+#define DECODE_CACHE_BYTES (8 << 20)
 
-	memcpy(buf + off, end, sizeof(end)); // will NULL terminate
-	return true;
+static Decode_cache *strings; // shared by the decoder and its workers
+static size_t cache_hits, cache_misses, cache_evictions, cache_bytes;
+
+/*
+ * the cache entry for a lexeme, decoding it on a miss. NULL for lexemes not
+ * worth caching, or if memory ran out, decode_lexeme those.
+*/
+static Decode_entry *decode_cached(Scratch *s, const char *value, size_t len, tokentype type) {
+	if (!strings || len < DECODE_CACHE_MIN
+		|| (!memchr(value, '\\', len) && !b64_plausible(value + 1, len - 2))) {
+		return NULL;
+	}
+	uint64_t hash = decode_cache_hash(value, len);
+	Decode_entry *e = decode_cache_get(strings, value, len, hash);
+	if (e) {
+		return e;
+	}
+	size_t res_len = len;
+	bool lit;
+	const char *res = decode_lexeme(s, value, &res_len, type, &lit);
+	e = decode_cache_put(strings, value, len, hash, res, res_len);
+	if (lit) {
+		free((void *) res);
+	}
+	return e;
 }
 
-static bool decoder(List *in, List *out) {
-	Token *tok = NULL;
-	while ((tok = token_list_dequeue(in)) != NULL) {
-		switch (tok->type) {
-			case TOKEN_DOUBLE_QUOTE_STRING:
-			case TOKEN_SINGLE_QUOTE_STRING:
-			case TOKEN_TILDA_STRING:
-				// potentially decode content of tok->value in place
-				decode_string(tok);
-				break;
-			default:
-				break;
+typedef struct {
+	Token_writer w;
+	Scratch scratch;
+	tokentype last; // of the last token written
+} Decoder;
+
+static bool copy_token(Decoder *d, const TokenBlock *b, size_t i) {
+	d->last = b->type[i];
+	return token_writer_copy(&d->w, b, i);
+}
+
+/*
+ * token i of b, spelled value instead. A btoa literal right after a word,
+ * like case"...", gets a space or it would join onto it.
+*/
+static bool put_string(Decoder *d, const TokenBlock *b, size_t i, const char *value, size_t len) {
+	if (value[0] == 'b' && d->last >= TOKEN_VAR) {
+		Token space = {
+			.value = " ",
+			.length = 1,
+			.type = TOKEN_SPACE,
+		};
+		if (!token_writer_put(&d->w, &space, b->pos_base + b->pos[i])) {
+			return false;
+		}
+	}
+	d->last = b->type[i];
+	Token tok = {
+		.value = value,
+		.length = len,
+		.type = b->type[i],
+		.flags = b->flags[i] & ~TOKEN_OWN,
+	};
+	return token_writer_put(&d->w, &tok, b->pos_base + b->pos[i]);
+}
+
+// token i of b, as the cache entry has it
+static bool put_entry(Decoder *d, const TokenBlock *b, size_t i, Decode_entry *e) {
+	size_t len;
+	const char *value = decode_entry_value(e, &len);
+	bool ret = value ? put_string(d, b, i, value, len) : copy_token(d, b, i);
+	decode_cache_release(strings, e);
+	return ret;
+}
+
+static inline bool is_string(tokentype t) {
+	switch (t) {
+	case TOKEN_DOUBLE_QUOTE_STRING:
+	case TOKEN_SINGLE_QUOTE_STRING:
+	case TOKEN_TILDA_STRING:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * only strings are looked at, everything else is copied from block to block
+ * without becoming a Token
+*/
+static bool decode_token(Decoder *d, const TokenBlock *b, size_t i) {
+	if (!is_string(b->type[i])) {
+		return copy_token(d, b, i);
+	}
+	size_t len = b->length[i];
+	Decode_entry *e = decode_cached(&d->scratch, token_block_lexeme(b, i), len, b->type[i]);
+	if (e) {
+		return put_entry(d, b, i, e);
+	}
+	bool lit;
+	const char *value = decode_lexeme(&d->scratch, token_block_lexeme(b, i), &len, b->type[i], &lit);
+	if (!value) {
+		return copy_token(d, b, i);
+	}
+	bool ret = put_string(d, b, i, value, len);
+	if (lit) {
+		free((void *) value);
+	}
+	return ret;
+}
+
+static bool decoder_serial(Decoder *d, Channel *in) {
+	TokenBlock *b;
+	bool status = true;
+	while (status && (b = token_stream_head(in)) != NULL) {
+		status = decode_token(d, b, b->next++);
+	}
+	return status;
+}
+
+/*
+ * Fan out. Strings of DECODE_FANOUT_LEN or more are handed to workers while
+ * the decoder reads on, everything else is done on the decoder's thread.
+ * Input blocks are held until they are written, and they are written in
+ * order: jobs are numbered as they are handed out and a string is written
+ * once job number written is done. Only window jobs and DECODE_HELD blocks
+ * are out at a time.
+*/
+#define DECODE_FANOUT_LEN 1024 // strings this long are worth a hand-off
+#define DECODE_WINDOW     16   // jobs in flight per worker
+#define DECODE_HELD       64   // input blocks held back at most
+
+typedef struct {
+	const char *value; // lexeme, in a block that is held until the job is written
+	size_t len;
+	tokentype type;
+	Decode_entry *entry; // what it decodes to when cached
+	char *res;         // otherwise, NULL if it stays as it is
+	size_t res_len;
+	bool done;
+} Decode_job;
+
+typedef struct {
+	size_t jobs, bytes;
+	double busy; // seconds spent decoding
+} Decode_worker_stats;
+
+typedef struct {
+	Decode_job *jobs; // ring of window slots
+	size_t window;
+	size_t added;     // jobs handed out
+	size_t next;      // next job for a worker to pick up
+	size_t written;   // jobs already written
+	bool halt;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Fanout;
+
+typedef struct {
+	Fanout *f;
+	Decode_worker_stats stats;
+} Decode_worker;
+
+typedef struct {
+	TokenBlock *b[DECODE_HELD];
+	size_t in, out; // blocks held, blocks written
+	uint32_t scan;  // next token of the newest block to look at
+} Held;
+
+// stats of the last fan out, read once the stage is done
+static Decode_worker_stats *worker_stats;
+static int worker_count;
+static size_t own_jobs;
+static double fanout_time;
+
+static inline bool fans_out(const TokenBlock *b, size_t i) {
+	return is_string(b->type[i]) && b->length[i] >= DECODE_FANOUT_LEN;
+}
+
+static inline double seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run_job(Decode_job *j, Scratch *s) {
+	j->res = NULL;
+	if ((j->entry = decode_cached(s, j->value, j->len, j->type)) != NULL) {
+		return;
+	}
+	size_t len = j->len;
+	bool lit;
+	const char *value = decode_lexeme(s, j->value, &len, j->type, &lit);
+	if (value && !lit && (j->res = (char *) malloc(len)) != NULL) {
+		memcpy(j->res, value, len);
+	} else if (lit) {
+		j->res = (char *) value;
+	}
+	j->res_len = len;
+}
+
+static void *decode_worker(void *in) {
+	Decode_worker *wk = (Decode_worker *) in;
+	Fanout *f = wk->f;
+	Scratch s = { 0 };
+	stage_pin_self();
+	pthread_mutex_lock(&f->lock);
+	for (;;) {
+		while (!f->halt && f->next == f->added) {
+			pthread_cond_wait(&f->cond, &f->lock);
+		}
+		if (f->next == f->added) {
+			break;
+		}
+		Decode_job *j = &f->jobs[f->next++ % f->window];
+		pthread_mutex_unlock(&f->lock);
+
+		double start = seconds();
+		run_job(j, &s);
+		wk->stats.busy += seconds() - start;
+		wk->stats.jobs++;
+		wk->stats.bytes += j->len;
+
+		pthread_mutex_lock(&f->lock);
+		j->done = true;
+		pthread_cond_broadcast(&f->cond);
+	}
+	pthread_mutex_unlock(&f->lock);
+	free(s.buf);
+	return NULL;
+}
+
+/*
+ * writes the oldest job's string, token i of b, once it is done. Decodes it
+ * here if no worker got to it.
+*/
+static bool write_job(Decoder *d, Fanout *f, const TokenBlock *b, size_t i) {
+	Decode_job *j = &f->jobs[f->written % f->window];
+	pthread_mutex_lock(&f->lock);
+	if (f->next == f->written) {
+		f->next++;
+		pthread_mutex_unlock(&f->lock);
+		run_job(j, &d->scratch);
+		own_jobs++;
+		pthread_mutex_lock(&f->lock);
+		j->done = true;
+	}
+	while (!j->done) {
+		pthread_cond_wait(&f->cond, &f->lock);
+	}
+	pthread_mutex_unlock(&f->lock);
+	bool ret;
+	if (j->entry) {
+		ret = put_entry(d, b, i, j->entry);
+	} else {
+		ret = j->res ? put_string(d, b, i, j->res, j->res_len) : copy_token(d, b, i);
+	}
+	free(j->res);
+	j->res = NULL;
+	j->entry = NULL;
+	f->written++; // only the decoder looks at it
+	return ret;
+}
+
+static bool job_done(Fanout *f) {
+	pthread_mutex_lock(&f->lock);
+	bool done = f->jobs[f->written % f->window].done;
+	pthread_mutex_unlock(&f->lock);
+	return done;
+}
+
+typedef enum {
+	EMIT_READY, // up to the first job that isn't done
+	EMIT_JOB,   // up to and including the oldest job
+	EMIT_BLOCK, // until the oldest block is written
+	EMIT_ALL,
+} Emit;
+
+/*
+ * writes held tokens in order, as far as until says. Every long string it
+ * gets to has a job, only EMIT_JOB is used before the newest block is
+ * scanned and it stops at a job before the scan.
+*/
+static bool emit(Decoder *d, Fanout *f, Held *h, Emit until) {
+	while (h->out != h->in) {
+		TokenBlock *b = h->b[h->out % DECODE_HELD];
+		if (b->next == b->count) {
+			token_block_free(b);
+			h->out++;
+			if (until == EMIT_BLOCK) {
+				return true;
+			}
+			continue;
+		}
+		size_t i = b->next;
+		if (!fans_out(b, i)) {
+			b->next++;
+			if (!decode_token(d, b, i)) {
+				return false;
+			}
+			continue;
+		}
+		if (until == EMIT_READY && !job_done(f)) {
+			return true;
 		}
-		if (!list_append_block(out, tok)) {
+		b->next++;
+		if (!write_job(d, f, b, i)) {
 			return false;
 		}
+		if (until == EMIT_JOB) {
+			return true;
+		}
 	}
 	return true;
 }
 
-static void *decoder_start(void *args) {
-	Thread_params *t = (Thread_params *) args;
-	List *in = (List *)t->input;
-	List *out = (List *)t->output;
-	free (t);
-	decoder(in, out);
-	list_destroy(in);
-	list_producer_fin(out);
-	return NULL;
+// hands the long strings of the newest held block to the workers
+static bool scan_block(Decoder *d, Fanout *f, Held *h) {
+	TokenBlock *b = h->b[(h->in - 1) % DECODE_HELD];
+	for (; h->scan < b->count; h->scan++) {
+		size_t i = h->scan;
+		if (!fans_out(b, i)) {
+			continue;
+		}
+		if (f->added - f->written == f->window && !emit(d, f, h, EMIT_JOB)) {
+			return false;
+		}
+		Decode_job *j = &f->jobs[f->added % f->window];
+		j->value = token_block_lexeme(b, i);
+		j->len = b->length[i];
+		j->type = b->type[i];
+		j->done = false;
+		pthread_mutex_lock(&f->lock);
+		f->added++;
+		pthread_cond_broadcast(&f->cond);
+		pthread_mutex_unlock(&f->lock);
+	}
+	return true;
 }
 
-List *decoder_creat_start_thread(List *tokens) {
-	if (!tokens) {
-		return NULL;
+static bool decoder_parallel(Decoder *d, Channel *in, int workers) {
+	Fanout f = {
+		.window = (size_t) workers * DECODE_WINDOW,
+	};
+	Held h = { 0 };
+	f.jobs = (Decode_job *) calloc(f.window, sizeof(Decode_job));
+	Decode_worker *wks = (Decode_worker *) calloc(workers, sizeof(Decode_worker));
+	pthread_t *tids = (pthread_t *) malloc(workers * sizeof(pthread_t));
+	if (!f.jobs || !wks || !tids) {
+		free(f.jobs);
+		free(wks);
+		free(tids);
+		return decoder_serial(d, in);
 	}
 
-	List *out = list_new(tokens->free, true);
-	if (!out) {
-		list_destroy(tokens);
-		return NULL;
+	pthread_mutex_init(&f.lock, NULL);
+	pthread_cond_init(&f.cond, NULL);
+	double start = seconds();
+	int started = 0;
+	while (started < workers) {
+		wks[started].f = &f;
+		if (pthread_create(&tids[started], NULL, decode_worker, (void *) &wks[started]) != 0) {
+			break;
+		}
+		started++;
 	}
 
-	Thread_params *t = (Thread_params *)malloc(sizeof(Thread_params));
-	if (!t) {
-		list_destroy(tokens);
-		list_destroy(out);
-		return NULL;
+	bool ret = true;
+	TokenBlock *b;
+	while (ret && (b = (TokenBlock *) channel_pop_block(in)) != NULL) {
+		if (h.in - h.out == DECODE_HELD && !(ret = emit(d, &f, &h, EMIT_BLOCK))) {
+			token_block_free(b);
+			break;
+		}
+		h.b[h.in++ % DECODE_HELD] = b;
+		h.scan = b->next;
+		// don't hold back what is ready
+		ret = scan_block(d, &f, &h) && emit(d, &f, &h, EMIT_READY);
+	}
+	if (ret) {
+		ret = emit(d, &f, &h, EMIT_ALL);
+	}
+	// after a failure jobs are only waited for, their strings dropped
+	pthread_mutex_lock(&f.lock);
+	while (f.written < f.added) {
+		Decode_job *j = &f.jobs[f.written % f.window];
+		if (f.next == f.written) {
+			f.next++;
+			j->res = NULL;
+			j->entry = NULL;
+			j->done = true;
+		}
+		while (!j->done) {
+			pthread_cond_wait(&f.cond, &f.lock);
+		}
+		free(j->res);
+		if (j->entry) {
+			decode_cache_release(strings, j->entry);
+		}
+		f.written++;
 	}
+	f.halt = true;
+	pthread_cond_broadcast(&f.cond);
+	pthread_mutex_unlock(&f.lock);
+	while (h.out != h.in) {
+		token_block_free(h.b[h.out++ % DECODE_HELD]);
+	}
+
+	while (started--) {
+		pthread_join(tids[started], NULL);
+	}
+	fanout_time = seconds() - start;
+	worker_count = workers;
+	worker_stats = (Decode_worker_stats *) malloc(workers * sizeof(Decode_worker_stats));
+	for (int k = 0; worker_stats && k < workers; k++) {
+		worker_stats[k] = wks[k].stats;
+	}
+	pthread_cond_destroy(&f.cond);
+	pthread_mutex_destroy(&f.lock);
+	free(f.jobs);
+	free(wks);
+	free(tids);
+	return ret;
+}
 
-	t->input = (void *)tokens;
-	t->output = (void *)out;
+typedef struct {
+	int workers;
+} Decoder_params;
+
+static void decoder_start(Channel *in, Channel *out, void *arg) {
+	Decoder_params *dp = (Decoder_params *) arg;
+	int workers = dp->workers;
+	free(dp);
+
+	Decoder d = { 0 };
+	token_writer_init(&d.w, out, NULL);
+	strings = decode_cache_new(DECODE_CACHE_BYTES); // without it every string is decoded
+	if (workers > 1) {
+		decoder_parallel(&d, in, workers);
+	} else {
+		decoder_serial(&d, in);
+	}
+	token_writer_flush(&d.w);
+	free(d.scratch.buf);
+	if (strings) {
+		decode_cache_stats(strings, &cache_hits, &cache_misses, &cache_evictions, &cache_bytes);
+		decode_cache_destroy(strings);
+		strings = NULL;
+	}
+}
 
-	if (pthread_create(&out->thread->tid, &out->thread->attr, decoder_start, (void *) t) != 0) {
-		fprintf(stderr, "[!!] pthread_create failed\n");
-		list_destroy(tokens);
-		list_destroy(out);
-		free(t);
+Channel *decoder_creat_start_thread(Channel *tokens, int workers) {
+	if (!tokens) {
+		return NULL;
+	}
+	b64_tables_init();
+	Decoder_params *dp = (Decoder_params *) malloc(sizeof(Decoder_params));
+	if (!dp) {
+		channel_destroy(tokens);
 		return NULL;
 	}
+	dp->workers = workers;
+	Channel *out = token_stream_new(channel_capacity(TOKEN_BLOCK_FOOTPRINT, TOKEN_STREAM_BLOCKS));
+	out = stage_start("decoder", tokens, out, decoder_start, (void *) dp);
+	if (!out) {
+		free(dp);
+	}
 	return out;
 }
+
+void decoder_print_stats(FILE *f) {
+	if (cache_hits || cache_misses) {
+		fprintf(f, "decode cache: %zu hits, %zu misses, %zu evicted, %zu KB held\n",
+			cache_hits, cache_misses, cache_evictions, cache_bytes / 1024);
+	}
+	if (!worker_stats) {
+		return;
+	}
+	size_t jobs = own_jobs;
+	for (int k = 0; k < worker_count; k++) {
+		Decode_worker_stats *ws = &worker_stats[k];
+		jobs += ws->jobs;
+		fprintf(f, "decoder worker %d: %zu strings, %zu KB, %.0f%% busy\n", k, ws->jobs,
+			ws->bytes / 1024, fanout_time > 0 ? 100 * ws->busy / fanout_time : 0.0);
+	}
+	fprintf(f, "decoder: %zu of %zu long strings decoded on its own thread\n", own_jobs, jobs);
+}
@@ -1,5 +1,14 @@
-#include "list.h"
+#include <stdio.h>
+#include "channel.h"
 /*
- * consumer of tokens, producer of lines
+ * consumer of tokens, producer of tokens with their strings decoded. More
+ * than one worker decodes long strings on that many threads, tokens still
+ * come out in order.
 */
-List *decoder_creat_start_thread(List *tokens);
+Channel *decoder_creat_start_thread(Channel *tokens, int workers);
+
+/*
+ * how the decode cache did and how busy each decoder worker was over the
+ * last run, to size -j by. Workers are left out if the decoder ran alone.
+*/
+void decoder_print_stats(FILE *f);
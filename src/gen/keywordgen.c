@@ -0,0 +1,119 @@
+/*
+ * Builds the tokenizer's keyword table. Reads "word type class" lines (see
+ * keywords.txt) on stdin and writes a C header with a perfect hash table to
+ * stdout.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "../keyword_hash.h"
+
+#define MAX_KEYWORDS 256
+#define MAX_BITS     10
+#define TRIES        (1 << 22)
+
+typedef struct {
+	char word[KEYWORD_MAX_LEN + 1];
+	char type[64];
+	char class[64];
+	size_t len;
+} Entry;
+
+static Entry entries[MAX_KEYWORDS];
+static size_t count;
+
+static bool read_keywords(FILE *in) {
+	char line[256];
+	size_t lineno = 0;
+	while (fgets(line, sizeof(line), in)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if (count == MAX_KEYWORDS) {
+			fprintf(stderr, "too many keywords\n");
+			return false;
+		}
+		Entry *e = &entries[count];
+		char word[256];
+		if (sscanf(line, "%255s %63s %63s", word, e->type, e->class) != 3) {
+			fprintf(stderr, "line %zu: expected word, type and class\n", lineno);
+			return false;
+		}
+		e->len = strlen(word);
+		if (e->len < KEYWORD_MIN_LEN || e->len > KEYWORD_MAX_LEN) {
+			fprintf(stderr, "line %zu: %s is too short or too long to hash\n", lineno, word);
+			return false;
+		}
+		memcpy(e->word, word, e->len + 1);
+		count++;
+	}
+	return true;
+}
+
+static bool is_perfect(uint32_t mul, int bits, int *slots) {
+	size_t i;
+	memset(slots, -1, sizeof(int) << bits);
+	for (i = 0; i < count; i++) {
+		uint32_t h = keyword_hash((const unsigned char *) entries[i].word, entries[i].len, mul, bits);
+		if (slots[h] >= 0) {
+			return false;
+		}
+		slots[h] = (int) i;
+	}
+	return true;
+}
+
+// fixed seed, the same keywords always give the same table
+static bool find_multiplier(int bits, int *slots, uint32_t *mul) {
+	uint32_t state = 0x9e3779b9;
+	size_t t;
+	for (t = 0; t < TRIES; t++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		*mul = state | 1;
+		if (is_perfect(*mul, bits, slots)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(void) {
+	static int slots[1 << MAX_BITS];
+	if (!read_keywords(stdin)) {
+		return 1;
+	}
+
+	uint32_t mul;
+	int bits;
+	for (bits = 1; (1u << bits) < count; bits++);
+	for (; bits <= MAX_BITS; bits++) {
+		if (find_multiplier(bits, slots, &mul)) {
+			break;
+		}
+	}
+	if (bits > MAX_BITS) {
+		fprintf(stderr, "no perfect hash found, hash more bytes in keyword_hash\n");
+		return 1;
+	}
+
+	printf("/* generated by gen/keywordgen from gen/keywords.txt, do not edit */\n");
+	printf("#define KEYWORD_MUL  0x%08xu\n", mul);
+	printf("#define KEYWORD_BITS %d\n\n", bits);
+	printf("static const Keyword keyword_table[1 << KEYWORD_BITS] = {\n");
+	size_t s;
+	for (s = 0; s < (1u << bits); s++) {
+		if (slots[s] < 0) {
+			continue;
+		}
+		Entry *e = &entries[slots[s]];
+		printf("\t[%zu] = {{\"%s\"}, %zu, %s, TOKEN_FLAG_%s},\n",
+			s, e->word, e->len, e->type, e->class);
+	}
+	printf("};\n");
+	return 0;
+}
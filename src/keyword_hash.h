@@ -0,0 +1,23 @@
+#ifndef _KEYWORDHASHGUARD
+#define _KEYWORDHASHGUARD 1
+#include <stddef.h>
+#include <stdint.h>
+
+#define KEYWORD_MIN_LEN 2
+#define KEYWORD_MAX_LEN 16 // compared as two 8 byte words
+
+/*
+ * Shared by gen/keywordgen and the tokenizer. Only the first two bytes, the
+ * last byte and the length are hashed, keywordgen picks a multiplier that gives
+ * every keyword a slot of its own.
+ *
+ * len must be at least KEYWORD_MIN_LEN
+*/
+static inline uint32_t keyword_hash(const unsigned char *buf, size_t len, uint32_t mul, int bits) {
+	uint32_t key = buf[0]
+		| (uint32_t) buf[1] << 8
+		| (uint32_t) buf[len - 1] << 16
+		| (uint32_t) len << 24;
+	return (key * mul) >> (32 - bits);
+}
+#endif
@@ -0,0 +1,63 @@
+/* generated by gen/keywordgen from gen/keywords.txt, do not edit */
+#define KEYWORD_MUL  0x5489b9bfu
+#define KEYWORD_BITS 7
+
+static const Keyword keyword_table[1 << KEYWORD_BITS] = {
+	[3] = {{"of"}, 2, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[5] = {{"debugger"}, 8, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[6] = {{"if"}, 2, TOKEN_IF, TOKEN_FLAG_RESERVED},
+	[7] = {{"break"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[8] = {{"catch"}, 5, TOKEN_CATCH, TOKEN_FLAG_RESERVED},
+	[10] = {{"from"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[13] = {{"var"}, 3, TOKEN_VAR, TOKEN_FLAG_RESERVED},
+	[15] = {{"delete"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[17] = {{"target"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[18] = {{"case"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[20] = {{"in"}, 2, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[23] = {{"eval"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[24] = {{"finally"}, 7, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[27] = {{"implements"}, 10, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[28] = {{"void"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[29] = {{"with"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[30] = {{"public"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[31] = {{"new"}, 3, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[33] = {{"while"}, 5, TOKEN_WHILE, TOKEN_FLAG_RESERVED},
+	[34] = {{"return"}, 6, TOKEN_RETURN, TOKEN_FLAG_RESERVED},
+	[39] = {{"const"}, 5, TOKEN_CONST, TOKEN_FLAG_RESERVED},
+	[41] = {{"instanceof"}, 10, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[42] = {{"throw"}, 5, TOKEN_THROW, TOKEN_FLAG_RESERVED},
+	[45] = {{"for"}, 3, TOKEN_FOR, TOKEN_FLAG_RESERVED},
+	[46] = {{"super"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[51] = {{"let"}, 3, TOKEN_LET, TOKEN_FLAG_CONTEXTUAL},
+	[52] = {{"function"}, 8, TOKEN_FUNCTION, TOKEN_FLAG_RESERVED},
+	[59] = {{"async"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[66] = {{"arguments"}, 9, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[70] = {{"export"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[73] = {{"extends"}, 7, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[75] = {{"protected"}, 9, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[77] = {{"enum"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[78] = {{"null"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[84] = {{"continue"}, 8, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[85] = {{"try"}, 3, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[86] = {{"package"}, 7, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[87] = {{"this"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[88] = {{"static"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[89] = {{"meta"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[91] = {{"set"}, 3, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[92] = {{"else"}, 4, TOKEN_ELSE, TOKEN_FLAG_RESERVED},
+	[93] = {{"yield"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[95] = {{"default"}, 7, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[96] = {{"get"}, 3, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[98] = {{"do"}, 2, TOKEN_FOR, TOKEN_FLAG_RESERVED},
+	[105] = {{"private"}, 7, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[106] = {{"as"}, 2, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[108] = {{"interface"}, 9, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+	[112] = {{"false"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[113] = {{"typeof"}, 6, TOKEN_TYPEOF, TOKEN_FLAG_RESERVED},
+	[115] = {{"true"}, 4, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[119] = {{"switch"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[121] = {{"await"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[122] = {{"import"}, 6, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[123] = {{"class"}, 5, TOKEN_VARIABLE, TOKEN_FLAG_RESERVED},
+	[125] = {{"accessor"}, 8, TOKEN_VARIABLE, TOKEN_FLAG_CONTEXTUAL},
+};
@@ -26,7 +26,7 @@ static inline void update_line_stats(Line *line, Token *tok, bool added) {
 	}
 }
 
-static inline Token *line_dequeue_token(Line *line) {
+Token *line_dequeue_token(Line *line) {
 	Token *tok = (Token *)list_dequeue_block (line->tokens);
 	if (tok) {
 		update_line_stats (line, tok, false);
@@ -85,8 +85,61 @@ void line_free(Line *l) {
 	}
 }
 
-List *lines_list_new() {
-	return list_new ((void (*)(void *))&line_free, true);
+void line_block_free(void *v) {
+	LineBlock *b = (LineBlock *)v;
+	if (b) {
+		for (uint32_t i = b->next; i < b->count; i++) {
+			line_free (b->lines[i]);
+		}
+		free (b);
+	}
+}
+
+Channel *lines_channel_new() {
+	return channel_new (&line_block_free,
+		channel_capacity (LINE_FOOTPRINT * LINE_BLOCK_CAP, LINE_CHANNEL_LINES / LINE_BLOCK_CAP));
+}
+
+void line_writer_init(Line_writer *w, Channel *out) {
+	w->out = out;
+	w->block = NULL;
+}
+
+bool line_writer_flush(Line_writer *w) {
+	LineBlock *b = w->block;
+	w->block = NULL;
+	if (!b) {
+		return true;
+	}
+	return channel_push_batch (w->out, b, b->count);
+}
+
+bool line_writer_put(Line_writer *w, Line *line) {
+	if (!w->block) {
+		w->block = (LineBlock *)malloc (sizeof (LineBlock));
+		if (!w->block) {
+			line_free (line);
+			channel_status_set_flag (w->out, LIST_MEMFAIL);
+			return false;
+		}
+		w->block->count = w->block->next = 0;
+	}
+	w->block->lines[w->block->count++] = line;
+	if (w->block->count == LINE_BLOCK_CAP) {
+		return line_writer_flush (w);
+	}
+	return true;
+}
+
+Line *lines_channel_next(Channel *c) {
+	LineBlock *b;
+	while ((b = (LineBlock *)channel_peek_block (c)) != NULL) {
+		if (b->next < b->count) {
+			return b->lines[b->next++];
+		}
+		channel_drop_head (c);
+	}
+	return NULL;
 }
 
 Line *line_new(size_t n, int indent) {
@@ -96,6 +149,8 @@ Line *line_new(size_t n, int indent) {
 			l->type = LINE_NONE;
 			l->num = n;
 			l->indent = indent;
+			l->char_len = 0;
+			l->cnt_logic = l->cnt_comma = l->cnt_ternary = 0;
 			return l;
 		}
 		line_free (l);
@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include "list.h"
+#include "channel.h"
 #include "lines.h"
 #include "tokenizer.h"
 
@@ -19,14 +21,54 @@ typedef struct {
 	size_t cnt_logic, cnt_comma,  cnt_ternary;
 } Line;
 
+#define LINE_CHANNEL_LINES 1024 // lines in flight between two stages
+#define LINE_FOOTPRINT     1024 // bytes a queued line and its tokens take, roughly
+
+/*
+ * Lines are handed between stages a block at a time, one push per block
+ * instead of one per line
+*/
+#define LINE_BLOCK_CAP 64
+
+typedef struct {
+	Line *lines[LINE_BLOCK_CAP];
+	uint32_t count; // lines in the block
+	uint32_t next;  // next line for the consumer
+} LineBlock;
+
+typedef struct {
+	Channel *out;
+	LineBlock *block; // private to the producer until it is full
+} Line_writer;
+
 #define line_dec_indent(line) (line->indent && line->indent--)
 #define line_inc_indent(line) (line->indent++)
 
 bool line_append(Line *line, Token *token);
 tokentype line_switch(Line *in, Line *out);
+Token *line_dequeue_token(Line *line);
 bool line_append_space(Line *line);
 tokentype line_peek_last_type(Line *line);
 void line_free(Line *l);
-List *lines_list_new();
+Channel *lines_channel_new();
+
+// frees a block and the lines in it the consumer hasn't taken
+void line_block_free(void *b);
+void line_writer_init(Line_writer *w, Channel *out);
+
+/*
+ * adds line to the writer's block, handing it on when full. False if memory
+ * ran out or the consumer halted, line is freed then.
+*/
+bool line_writer_put(Line_writer *w, Line *line);
+
+// hands on the writer's block, call before the producer finishes
+bool line_writer_flush(Line_writer *w);
+
+/*
+ * takes the next line from a channel of line blocks, blocking until there is
+ * one. NULL when the producer is done.
+*/
+Line *lines_channel_next(Channel *c);
 Line *line_new(size_t n, int indent);
 bool line_ends_with_type(Line *line);
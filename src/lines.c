@@ -1,8 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "tokenizer.h"
+#include "token_block.h"
 #include "lines.h"
-#include "threads.h"
+#include "stage.h"
 #include "line_utils.h"
 
 typedef enum {
@@ -11,9 +12,13 @@ typedef enum {
 	LRET_END_INC_INDENT,
 	LRET_END_DEC_INDENT,
 	LRET_END,
+	LRET_END_PACK,            // row of a data literal is full, more may follow
+	LRET_END_INC_INDENT_PACK, // `{` that may open a data literal
 	LRET_CONTINUE,
 } lineret;
 
+#define PACK_WIDTH 80 // a packed row ends after the element that reaches this
+
 #define LINE_APPEND(line, token) { \
 	if (!line_append (line, token)) { \
 		return LRET_HALT_ERR; \
@@ -45,13 +50,14 @@ static inline bool is_valid_op_serpator(tokentype t) {
 	}
 }
 
-static inline bool maybe_space_surround(List *tokens, Line *line) {
+// op is the operator, already taken off tokens
+static inline bool maybe_space_surround(Channel *tokens, Line *line, Token *op) {
 	if (is_valid_op_serpator (line_peek_last_type (line))) {
 		if (!line_append_space (line)) {
 			return false;
 		}
 	}
-	LINE_APPEND (line, token_list_dequeue (tokens));
+	LINE_APPEND (line, op);
 	if (is_valid_op_serpator(token_list_peek_type (tokens))) {
 		if (!line_append_space (line)) {
 			return false;
@@ -60,7 +66,7 @@ static inline bool maybe_space_surround(List *tokens, Line *line) {
 	return true;
 }
 
-static lineret append_until_paren_fin(List *tokens, Line *line) {
+static lineret append_until_paren_fin(Channel *tokens, Line *line) {
 	Token *tok = token_list_dequeue (tokens);
 
 	LINE_APPEND (line, tok)
@@ -112,13 +118,24 @@ static lineret append_until_paren_fin(List *tokens, Line *line) {
 		case TOKEN_GREATERTHAN_OR_EQUAL:
 		case TOKEN_EQUAL_EQUAL_EQUAL:
 		case TOKEN_NOT_EQUAL_EQUAL:
-			if (!maybe_space_surround (tokens, line)) {
+			if (!maybe_space_surround (tokens, line, tok)) {
 				return LRET_HALT_ERR;
 			}
 			break;
+		case TOKEN_NEWLINE:
+		case TOKEN_SPACE:
+		case TOKEN_TAB:
 		case TOKEN_CARRAGE_RETURN:
-			// remove
-			tokens->free(tok);
+			if (tok->newlines) {
+				// TODO delete newline?
+				LINE_APPEND (line, tok);
+				return LRET_END;
+			} else if (tok->type == TOKEN_CARRAGE_RETURN) {
+				// remove
+				token_free (tok);
+			} else {
+				LINE_APPEND (line, tok);
+			}
 			break;
 		case TOKEN_SEMICOLON:
 		case TOKEN_COMMA:
@@ -138,11 +155,7 @@ static lineret append_until_paren_fin(List *tokens, Line *line) {
 			depth--;
 			break;
 		case TOKEN_EOF:
-			tokens->free (tok);
-			return LRET_END;
-		case TOKEN_NEWLINE:
-			// TODO delete newline?
-			LINE_APPEND  (line, tok);
+			token_free (tok);
 			return LRET_END;
 		default:
 			LINE_APPEND (line, tok);
@@ -152,11 +165,70 @@ static lineret append_until_paren_fin(List *tokens, Line *line) {
 	return LRET_CONTINUE;
 }
 
+static inline bool is_datum(tokentype t) {
+	switch (t) {
+	case TOKEN_DOUBLE_QUOTE_STRING:
+	case TOKEN_SINGLE_QUOTE_STRING:
+	case TOKEN_TILDA_STRING:
+	case TOKEN_NUMERIC:
+	case TOKEN_VARIABLE: // true, false, null and names
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Data literals, like the tables bundles are full of, are laid out in rows of
+ * elements instead of a line each. Takes `value` and `key: value` elements
+ * made of one string, number or name, or a negative number, for as long as
+ * they come. A full row ends with LRET_END_PACK and the next one picks up
+ * from there. Anything else is left to finish_line, LRET_CONTINUE.
+ *
+ * Only whitespace at the start of an element is eaten, the value must be
+ * followed right away by its comma. Newlines that might end a statement are
+ * never dropped that way.
+*/
+static lineret pack_row(Channel *tokens, Line *line) {
+	tokentype t;
+	while (is_datum(t = token_list_consume_white_peek(tokens)) || t == TOKEN_SUBTRACT) {
+		if (t != TOKEN_SUBTRACT) {
+			LINE_APPEND (line, token_list_dequeue(tokens));
+			if (token_list_peek_type(tokens) != TOKEN_COLON) {
+				goto value_done;
+			}
+			LINE_APPEND (line, token_list_dequeue(tokens));
+			t = token_list_consume_white_peek(tokens);
+			LINE_APPEND_SPACE (line);
+		}
+		if (t == TOKEN_SUBTRACT) {
+			LINE_APPEND (line, token_list_dequeue(tokens));
+			if (token_list_peek_type(tokens) != TOKEN_NUMERIC) {
+				return LRET_CONTINUE;
+			}
+		} else if (!is_datum(t)) {
+			return LRET_CONTINUE;
+		}
+		LINE_APPEND (line, token_list_dequeue(tokens));
+value_done:
+		if (token_list_peek_type(tokens) != TOKEN_COMMA) {
+			// closing bracket or not data after all
+			return LRET_CONTINUE;
+		}
+		LINE_APPEND (line, token_list_dequeue(tokens));
+		if (line->char_len >= PACK_WIDTH) {
+			return LRET_END_PACK;
+		}
+		LINE_APPEND_SPACE (line);
+	}
+	return LRET_CONTINUE;
+}
+
 static inline size_t line_length(Line *line) {
 	return list_length(line->tokens);
 }
 
-static inline lineret curly_end(List *tokens, Line *line) {
+static inline lineret curly_end(Channel *tokens, Line *line) {
 	// all on one line
 	if (line_length (line)) {
 		token_list_snip_white_tail (line->tokens);
@@ -188,7 +260,7 @@ static inline lineret curly_end(List *tokens, Line *line) {
 	}
 }
 
-static inline lineret curly_open(List *tokens, Line *line) {
+static inline lineret curly_open(Channel *tokens, Line *line) {
 	// `if (){ /* <- this one */}`
 	if (line_peek_last_type (line) == TOKEN_CLOSE_PAREN) {
 		LINE_APPEND_SPACE (line);
@@ -204,10 +276,10 @@ static inline lineret curly_open(List *tokens, Line *line) {
 		token_list_consume_white_peek (tokens);
 		return LRET_CONTINUE;
 	}
-	return LRET_END_INC_INDENT;
+	return LRET_END_INC_INDENT_PACK;
 }
 
-static lineret finish_line(List *tokens, Line *line) {
+static lineret finish_line(Channel *tokens, Line *line) {
 	lineret ret;
 	tokentype t;
 	while ((t = token_list_peek_type (tokens)) != TOKEN_ERROR) {
@@ -249,7 +321,7 @@ static lineret finish_line(List *tokens, Line *line) {
 		case TOKEN_GREATERTHAN_OR_EQUAL:
 		case TOKEN_EQUAL_EQUAL_EQUAL:
 		case TOKEN_NOT_EQUAL_EQUAL:
-			if (!maybe_space_surround (tokens, line)) {
+			if (!maybe_space_surround (tokens, line, token_list_dequeue (tokens))) {
 				return LRET_HALT_ERR;
 			}
 			break;
@@ -279,8 +351,15 @@ static lineret finish_line(List *tokens, Line *line) {
 				return ret;
 			}
 			break;
+		case TOKEN_OPEN_BRACE:
+			LINE_APPEND (line, token_list_dequeue(tokens));
+			ret = pack_row (tokens, line);
+			if (ret != LRET_CONTINUE) {
+				return ret;
+			}
+			break;
 		case TOKEN_EOF:
-			tokens->free (token_list_dequeue (tokens));
+			token_free (token_list_dequeue (tokens));
 			return LRET_END;
 		case TOKEN_COMMA:
 		case TOKEN_SEMICOLON:
@@ -294,7 +373,7 @@ static lineret finish_line(List *tokens, Line *line) {
 	return LRET_END;
 }
 
-static lineret make_else_line(List *tokens, Line *line) {
+static lineret make_else_line(Channel *tokens, Line *line) {
 	Token *tok = token_list_dequeue(tokens);
 	if (!tok || tok->type != TOKEN_ELSE) {
 		return LRET_CONTINUE;
@@ -310,7 +389,7 @@ static lineret make_else_line(List *tokens, Line *line) {
 	return true;
 }
 
-static lineret make_logic_line(List *tokens, Line *line) {
+static lineret make_logic_line(Channel *tokens, Line *line) {
 	// append logic token for,wihle,if, etc
 	Token *tok = token_list_dequeue (tokens);
 	if (!tok) {
@@ -363,7 +442,7 @@ static lineret make_logic_line(List *tokens, Line *line) {
 	}
 }
 
-static inline lineret fill_line(List *tokens, Line *line, tokentype t) {
+static inline lineret fill_line(Channel *tokens, Line *line, tokentype t) {
 	switch (t) {
 	case TOKEN_STOP:
 		return LRET_HALT;
@@ -384,9 +463,10 @@ static inline lineret fill_line(List *tokens, Line *line, tokentype t) {
 	}
 }
 
-static inline void make_lines(List *tokens, List *lines) {
+static inline void make_lines(Channel *tokens, Line_writer *lines) {
 	size_t n = 0;
 	int indent = 0;
+	bool pack = false; // the line is a row of a data literal
 	do {
 		tokentype t = token_list_consume_white_peek (tokens);
 		if (t == TOKEN_STOP) {
@@ -398,8 +478,12 @@ static inline void make_lines(List *tokens, List *lines) {
 			return;
 		}
 
-		lineret ret = fill_line (tokens, line, t);
-		if (!list_append_block (lines, line)) {
+		lineret ret = pack ? pack_row (tokens, line) : LRET_CONTINUE;
+		if (ret == LRET_CONTINUE) {
+			ret = line_length (line) ? finish_line (tokens, line) : fill_line (tokens, line, t);
+		}
+		pack = false;
+		if (!line_writer_put (lines, line)) {
 			return;
 		}
 
@@ -410,6 +494,13 @@ static inline void make_lines(List *tokens, List *lines) {
 		case LRET_END_INC_INDENT:
 			indent++;
 			break;
+		case LRET_END_INC_INDENT_PACK:
+			indent++;
+			pack = true;
+			break;
+		case LRET_END_PACK:
+			pack = true;
+			break;
 		case LRET_END_DEC_INDENT:
 			if (indent) {
 				indent--;
@@ -428,44 +519,16 @@ static inline void make_lines(List *tokens, List *lines) {
 	} while (true);
 }
 
-static void *getlines(void *in) {
-	Thread_params *t = (Thread_params *) in;
-	List *tokens = (List *)t->input;
-	List *lines = (List *)t->output;
-	free (t);
-	make_lines(tokens, lines);
-	list_destroy(tokens);
-	list_producer_fin(lines);
-	return NULL;
+static void getlines(Channel *tokens, Channel *lines, void *arg) {
+	Line_writer w;
+	line_writer_init(&w, lines);
+	make_lines(tokens, &w);
+	line_writer_flush(&w);
 }
 
-List *lines_creat_start_thread(List *tokens) {
+Channel *lines_creat_start_thread(Channel *tokens) {
 	if (!tokens) {
 		return NULL;
 	}
-
-	List *lines = lines_list_new ();
-	if (!lines) {
-		list_destroy (tokens);
-		return NULL;
-	}
-
-	Thread_params *t = (Thread_params *)malloc(sizeof(Thread_params));
-	if (!t) {
-		list_destroy(tokens);
-		list_destroy(lines);
-		return NULL;
-	}
-
-	t->input = (void *)tokens;
-	t->output = (void *)lines;
-
-	if (pthread_create(&lines->thread->tid, &lines->thread->attr, getlines, (void *) t) != 0) {
-		fprintf(stderr, "[!!] pthread_create failed\n");
-		list_destroy (tokens);
-		list_destroy (lines);
-		free (t);
-		return NULL;
-	}
-	return lines;
+	return stage_start("lines", tokens, lines_channel_new(), getlines, NULL);
 }
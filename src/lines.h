@@ -4,4 +4,4 @@ List *lines_new();
 /*
  * consumer of tokens, producer of a line
 */
-List *lines_creat_start_thread(List *tokens);
+Channel *lines_creat_start_thread(Channel *tokens);
@@ -1,15 +1,22 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "tokenizer.h"
 #include "line_utils.h"
-#include "threads.h"
+#include "stage.h"
 
-static inline Line *get_line(List *tl) {
-	return (Line *) list_dequeue_block(tl);
+static inline Line *get_line(Channel *tl) {
+	return lines_channel_next (tl);
 }
 
+#define LINE_SIMPLE_LEN 160
+
+typedef struct {
+	size_t max_line; // 0 leaves long lines alone
+} Beautify_params;
+
 // quick parse to see if we want to do more to the line
-static bool line_simple(Line *line) {
+static bool line_simple(Line *line, size_t max_line) {
 	switch (line->type) {
 	case LINE_FOR:
 	case LINE_WHILE:
@@ -17,7 +24,7 @@ static bool line_simple(Line *line) {
 	default:
 		break;
 	}
-	if (line->char_len > 160) {
+	if (line->char_len > LINE_SIMPLE_LEN || (max_line && line->char_len > max_line)) {
 		return false;
 	}
 	if (line->cnt_comma + line->cnt_logic + line->cnt_ternary > 3) {
@@ -26,58 +33,224 @@ static bool line_simple(Line *line) {
 	return true;
 }
 
-// nothing fancy for now
-static inline bool deep_beauty(Line *line, List *outlines) {
-	return list_append_block (outlines, line);
+static inline size_t line_length(Line *line) {
+	return line->indent + line->char_len;
+}
+
+// a line can be broken right after t without changing what the code means
+static bool breaks_after(tokentype t, Line *rest) {
+	switch (t) {
+	case TOKEN_COMMA:
+	case TOKEN_SEMICOLON:
+	case TOKEN_COLON:
+	case TOKEN_LOGICAL_OR:
+	case TOKEN_LOGICAL_AND:
+	case TOKEN_NULL_COALESCING:
+		return true;
+	case TOKEN_QUESTIONMARK: {
+		// ?. is optional chaining, not a ternary
+		Token *next = (Token *)list_peek_head_block (rest->tokens);
+		return !next || next->type != TOKEN_DOT;
+	}
+	default:
+		return false;
+	}
+}
+
+/*
+ * how a run of tokens moves the output column. Whitespace runs can hold
+ * newlines, printed lines restart at the indent after them.
+*/
+typedef struct {
+	size_t first;  // bytes before the first newline, all of them without one
+	size_t last;   // bytes after the last newline
+	bool newline;
+	bool solid;      // something other than blanks before the first newline
+	bool solid_last; // and after the last one
+} Span;
+
+static inline bool is_white(Token *tok) {
+	switch (tok->type) {
+	case TOKEN_SPACE:
+	case TOKEN_TAB:
+	case TOKEN_NEWLINE:
+	case TOKEN_CARRAGE_RETURN:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void span_add(Span *s, Token *tok) {
+	if (!is_white (tok)) {
+		if (s->newline) {
+			s->solid_last = true;
+		} else {
+			s->solid = true;
+		}
+	}
+	if (!tok->newlines) {
+		if (s->newline) {
+			s->last += tok->length;
+		} else {
+			s->first += tok->length;
+		}
+		return;
+	}
+	const char *nl = memchr (tok->value, '\n', tok->length);
+	if (!s->newline) {
+		s->first += nl - tok->value;
+	}
+	size_t after = 0;
+	while (tok->value[tok->length - after - 1] != '\n') {
+		after++;
+	}
+	s->newline = true;
+	s->last = after;
+	s->solid_last = false;
 }
 
-static inline bool beautify_lines(List *inlines, List *outlines) {
+/*
+ * Breaking a line. col is where the piece being built ends, pend holds the
+ * tokens since the last break point and span what they add to it.
+*/
+typedef struct {
+	Line *piece;
+	size_t col;
+	Line *pend;
+	Span span;
+	size_t max_line;
+	bool continued; // piece is a continuation, nothing in it yet
+	bool blank;     // only blanks on the piece's last printed line
+} Breaker;
+
+/*
+ * moves the pending tokens onto the piece, first handing the piece on and
+ * starting a continuation if they don't fit
+*/
+static bool take_pending(Breaker *br, Line_writer *outlines) {
+	/*
+	 * no break if the piece's line is still empty, or nothing but blanks
+	 * would start the next one
+	*/
+	bool pointless = br->blank || !br->span.solid;
+	if (!pointless && br->col + br->span.first > br->max_line) {
+		Line *next = line_new (br->piece->num, br->pend->indent);
+		if (!next) {
+			return false;
+		}
+		Line *full = br->piece;
+		br->piece = next;
+		br->col = next->indent;
+		br->continued = true;
+		br->blank = true;
+		if (!line_writer_put (outlines, full)) {
+			return false;
+		}
+	}
+	Token *tok;
+	// a continuation doesn't start with blanks
+	while (br->continued && (tok = (Token *)list_peek_head_block (br->pend->tokens))
+		&& is_white (tok) && !tok->newlines) {
+		br->span.first -= tok->length;
+		token_free (line_dequeue_token (br->pend));
+	}
+	br->continued = false;
+	br->col = br->span.newline ? br->piece->indent + br->span.last : br->col + br->span.first;
+	br->blank = br->span.newline ? !br->span.solid_last : br->blank && !br->span.solid;
+	br->span = (Span) { 0 };
+
+	tokentype t;
+	while ((t = line_switch (br->pend, br->piece)) != TOKEN_STOP) {
+		if (t == TOKEN_ERROR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * breaks a long line into pieces of at most max_line where it can, after
+ * commas, semicolons, logical operators and ternaries. It is greedy and
+ * linear: tokens since the last break point wait in pend, and once the
+ * piece plus pend would be too long the piece is handed on and pend starts
+ * the next one, indented one more. Only pend is ever looked at again, so a
+ * stretch with no break points is the most that is held back.
+*/
+static bool deep_beauty(Line *line, Line_writer *outlines, size_t max_line) {
+	// nothing to break at, only for headers have semicolons
+	bool breakable = line->cnt_comma + line->cnt_logic + line->cnt_ternary || line->type == LINE_FOR;
+	if (!max_line || line_length (line) <= max_line || !breakable) {
+		return line_writer_put (outlines, line);
+	}
+
+	Breaker br = {
+		.piece = line_new (line->num, line->indent),
+		.col = line->indent,
+		.pend = line_new (line->num, line->indent + 1),
+		.max_line = max_line,
+		.blank = true,
+	};
+	bool ret = br.piece && br.pend;
+	tokentype t;
+	while (ret && (t = line_switch (line, br.pend)) != TOKEN_STOP) {
+		if (t == TOKEN_ERROR) {
+			ret = false;
+			break;
+		}
+		span_add (&br.span, (Token *)list_peek_tail (br.pend->tokens));
+		if (breaks_after (t, line)) {
+			ret = take_pending (&br, outlines);
+		}
+	}
+	if (ret && take_pending (&br, outlines)) {
+		ret = line_writer_put (outlines, br.piece);
+	} else {
+		line_free (br.piece);
+	}
+	line_free (br.pend);
+	line_free (line);
+	return ret;
+}
+
+static inline bool beautify_lines(Channel *inlines, Line_writer *outlines, size_t max_line) {
 	Line *line = NULL;
 	while ((line = get_line (inlines))) {
-		if (!line_simple (line)) {
-			if (!deep_beauty (line, outlines)) {
+		if (!line_simple (line, max_line)) {
+			if (!deep_beauty (line, outlines, max_line)) {
 				return false;
 			}
-		} else if (!list_append_block (outlines, line)){
+		} else if (!line_writer_put (outlines, line)){
 			return false;
 		}
 	}
 	return true;
 }
 
-static void *threadup_beautifyer(void *in) {
-	Thread_params *t = (Thread_params *) in;
-	List *inlines = (List *)t->input;
-	List *outlines = (List *)t->output;
-	free (t);
+static void threadup_beautifyer(Channel *inlines, Channel *outlines, void *arg) {
+	Beautify_params *bp = (Beautify_params *)arg;
+	size_t max_line = bp->max_line;
+	free (bp);
 
-	beautify_lines (inlines, outlines);
-	list_destroy (inlines);
-	list_producer_fin (outlines);
-	return NULL;
+	Line_writer w;
+	line_writer_init (&w, outlines);
+	beautify_lines (inlines, &w, max_line);
+	line_writer_flush (&w);
 }
 
-List* lines_beautify(List *lines) {
-	List *outlines = NULL;
-	if (lines && (outlines = lines_list_new ())) {
-		Thread_params *t = (Thread_params *)malloc (sizeof (Thread_params));
-		if (!t) {
-			list_destroy (lines);
-			list_destroy (outlines);
-			return NULL;
-		}
-
-		t->input = (void *)lines;
-		t->output = (void *)outlines;
-
-		if (pthread_create(&lines->thread->tid, &lines->thread->attr, threadup_beautifyer, (void *) t) != 0) {
-			fprintf (stderr, "[!!] line beautify pthread_create failed\n");
-			list_destroy (lines);
-			list_destroy (outlines);
-			free (t);
-			return NULL;
-		}
+Channel* lines_beautify(Channel *lines, size_t max_line) {
+	if (!lines) {
+		return NULL;
 	}
-
-	return outlines;
+	Beautify_params *bp = (Beautify_params *)malloc (sizeof (Beautify_params));
+	if (!bp) {
+		channel_destroy (lines);
+		return NULL;
+	}
+	bp->max_line = max_line;
+	Channel *out = stage_start ("beautify", lines, lines_channel_new (), threadup_beautifyer, (void *)bp);
+	if (!out) {
+		free (bp);
+	}
+	return out;
 }
@@ -1,4 +1,8 @@
 #include <stdbool.h>
-#include "list.h"
+#include "channel.h"
 
-List* lines_beautify(List *lines);
+/*
+ * tidies lines further. Lines longer than max_line bytes, indent tabs
+ * counting one each, are broken up where that is safe, 0 leaves them be.
+*/
+Channel* lines_beautify(Channel *lines, size_t max_line);
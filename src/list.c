@@ -49,6 +49,15 @@ static void list_unlock(List *l) {
 	}
 }
 
+// full once max elements are in, producers wait until the consumer takes one
+static inline void list_update_full(List *l) {
+	if (l->max && l->length >= l->max) {
+		l->status |= LIST_FULL;
+	} else {
+		l->status &= ~(LIST_FULL);
+	}
+}
+
 static void list_element_destroy(List_e *e) {
 	e->data = NULL;
 	free(e);
@@ -174,9 +183,10 @@ bool list_init(List *l, void (*destructor)(void *ptr), bool locked) {
 
 List_status list_set_max(List *l, size_t max) {
 	list_lock(l);
-	List_status s = l->status;
 	l->max = max;
-	list_lock(l);
+	list_update_full(l);
+	List_status s = l->status;
+	list_unlock(l);
 	return s;
 }
 
@@ -223,6 +233,10 @@ validate_list(l);
 }
 
 List_status list_append(List *l, void *data) {
+	return list_append_aux(l, data, 0);
+}
+
+List_status list_append_aux(List *l, void *data, size_t aux) {
 	list_lock(l);
 	List_status status = l->status;
 	if (LIST_IS_FULL(status) || LIST_IS_HALT_PRODUCER(status)) {
@@ -236,17 +250,18 @@ List_status list_append(List *l, void *data) {
 		return LIST_MEMFAIL;
 	}
 	e->data = data;
+	e->aux = aux;
 
 	List_e *old_tail = l->tail;
 	if (!old_tail) {
 		add_to_empty_list(l, e);
-		list_unlock(l);
-		return status;
+	} else {
+		old_tail->n = e;
+		e->p = old_tail;
+		l->tail = e;
+		l->length++;
 	}
-	old_tail->n = e;
-	e->p = old_tail;
-	l->tail = e;
-	l->length++;
+	list_update_full(l);
 
 	list_unlock(l);
 	return status;
@@ -254,12 +269,16 @@ List_status list_append(List *l, void *data) {
 
 // we know how to free inserts, so we do it for caller on failure
 bool list_append_block(List *l, void *data) {
+	return list_append_block_aux(l, data, 0);
+}
+
+bool list_append_block_aux(List *l, void *data, size_t aux) {
 	if (!data) {
 		return false;
 	}
 	List_status s;
 	do {
-		s = list_append(l, data);
+		s = list_append_aux(l, data, aux);
 		if (LIST_IS_HALT_PRODUCER(s)) {
 			l->free(data);
 			return false;
@@ -286,6 +305,7 @@ List_status list_dequeue(List *l, void **data) {
 	} else if (l->length == 1) {
 		l->head->p = NULL;
 	}
+	list_update_full(l);
 	list_unlock(l);
 
 	// save data
@@ -335,7 +355,7 @@ List_status list_status_set_flag(List *l, List_status s) {
 	return s;
 }
 
-List_status peek_head(List *l, void **data) {
+List_status peek_head(List *l, void **data, size_t *aux) {
 	list_lock(l);
 	List_status status = l->status;
 	if (!l->head) {
@@ -343,15 +363,21 @@ List_status peek_head(List *l, void **data) {
 		return status;
 	}
 	*data = l->head->data;
+	*aux = l->head->aux;
 	list_unlock(l);
 	return status;
 }
 
 void * list_peek_head_block(List *l) {
+	size_t aux;
+	return list_peek_head_block_aux(l, &aux);
+}
+
+void * list_peek_head_block_aux(List *l, size_t *aux) {
 	void *data = NULL;
 	List_status s;
 	for (;;) {
-		s = peek_head(l, &data);
+		s = peek_head(l, &data, aux);
 		if (LIST_IS_HALT_CONSUMER(s) || LIST_IS_DONE(s)) {
 			l->free(data);
 			return NULL;
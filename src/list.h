@@ -7,6 +7,7 @@ typedef unsigned char List_status;
 
 typedef struct list_element {
 	void *data;
+	size_t aux; // side channel for data that can't live in shared data, like where a flyweight token was found
 	struct list_element *n, *p;
 } List_e;
 
@@ -52,6 +53,7 @@ bool list_push(List *l, void *data);
 
 // interface for threaded consumer producer
 bool list_append_block(List *l, void *data);
+bool list_append_block_aux(List *l, void *data, size_t aux);
 void * list_dequeue_block(List *l);
 void list_consume_until(List *l, bool (*until)(void *, void *), void *args);
 void *list_peek_tail(List *l);
@@ -59,6 +61,7 @@ void list_consume_tail_until(List *l, bool (*until)(void *, void *), void *args)
 void list_destroy(List *l);
 List_status list_destroy_head(List *l);
 void * list_peek_head_block(List *l);
+void * list_peek_head_block_aux(List *l, size_t *aux);
 List_status list_status_set_flag(List *l, List_status s);
 List_status list_set_max(List *l, size_t max);
 
@@ -67,6 +70,7 @@ List *list_new(void (*destructor)(void *ptr), bool locked);
 // init and already allocated list
 bool list_init(List *l, void (*destructor)(void *ptr), bool locked);
 List_status list_append(List *l, void *data);
+List_status list_append_aux(List *l, void *data, size_t aux);
 List_status list_dequeue(List *l, void **data);
 
 // get length of list
@@ -1,18 +1,32 @@
+#define _GNU_SOURCE // sched_getaffinity
 #include <stdio.h>
 #include <stdlib.h> // exit
 #include <unistd.h>
+#include <getopt.h>
+#include <sched.h>
+
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
 #include <fcntl.h>
 
 #include "errorcodes.h"
 #include "tokenizer.h"
 #include "decoders.h"
+#include "unpacker.h"
+#include "string_tables.h"
 #include "lines.h"
 #include "lines_beautify.h"
 #include "ugly_lines.h"
 #include "printlines.h"
+#include "arena.h"
+#include "token_block.h"
+#include "stage.h"
+
+// inputs smaller than this run fused by default, threads cost more than they save
+#define FUSED_INPUT_MAX 0x10000
 
 
 void die(const char * msg) {
@@ -20,21 +34,81 @@ void die(const char * msg) {
 	exit(-1);
 }
 
+/*
+ * bytes with an optional K, M or G suffix, 0 if it doesn't parse
+*/
+static size_t parse_size(const char *s) {
+	char *end;
+	unsigned long long n = strtoull(s, &end, 10);
+	if (end == s) {
+		return 0;
+	}
+	switch (*end) {
+	case 'g': case 'G':
+		n <<= 10;
+		// fall through
+	case 'm': case 'M':
+		n <<= 10;
+		// fall through
+	case 'k': case 'K':
+		n <<= 10;
+		end++;
+		break;
+	default:
+		break;
+	}
+	return *end ? 0 : (size_t) n;
+}
+
 void usage(char *name) {
-	printf("%s [-hd] <js_file>\n", name);
+	printf("%s [-hdpsa] [-j workers] [-w spin|hybrid|park] [-m bytes] [-e auto|fused|threads|pool] [-l|--max-line-length chars] <js_file>\n", name);
 	printf("\n");
 	printf("\t-h\t help menu\n");
 	printf("\t-d\t do deobfuscation\n");
 	printf("\t-p\t pretty -> try to do more pretty stuff, increase chance of breaking code\n");
+	printf("\t-s\t print memory stats to stderr when done\n");
+	printf("\t-j\t threads used to tokenize large files, to render output and for the -e pool workers, defaults to the number of cores\n");
+	printf("\t-w\t how idle stages wait: spin keeps a core busy, park sleeps, hybrid (default) spins briefly then sleeps\n");
+	printf("\t-m\t max memory queued between stages, K, M and G suffixes work. Stages ahead wait when it is reached\n");
+	printf("\t-e\t fused runs every stage on one thread, threads gives each its own, pool shares -j worker threads between them. auto (default) fuses small files and single cpu machines\n");
+	printf("\t-a\t pin each thread to a core of its own\n");
+	printf("\t-l\t --max-line-length, break longer lines after commas, logical operators and ternaries where it is safe\n");
 }
 
+// cpus this process may run on, which can be fewer than the machine has
+static long usable_cpus(void) {
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		return CPU_COUNT(&set);
+	}
+	return sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+typedef enum {
+	EXEC_AUTO, EXEC_FUSED, EXEC_THREADS, EXEC_POOL,
+} Exec_mode;
+
 int main(int argc, char *argv[]) {
 	int fd = -1;
 	bool deobf = false;
 	bool pretty = false;
+	bool stats = false;
+	bool pin = false;
+	size_t max_memory = 0;
+	size_t max_line = 0;
+	Exec_mode exec = EXEC_AUTO;
+	long cpus = usable_cpus();
+	if (cpus < 1) {
+		cpus = 1;
+	}
+	long workers = cpus;
 
+	static const struct option long_opts[] = {
+		{ "max-line-length", required_argument, NULL, 'l' },
+		{ NULL, 0, NULL, 0 },
+	};
 	int opt;
-	while ((opt = getopt(argc, argv, "hdp")) != -1) {
+	while ((opt = getopt_long(argc, argv, "hdpsaj:w:m:e:l:", long_opts, NULL)) != -1) {
 		switch (opt) {
 		case 'h':
 			usage(argv[0]);
@@ -46,6 +120,60 @@ int main(int argc, char *argv[]) {
 		case 'p':
 			pretty = true;
 			break;
+		case 's':
+			stats = true;
+			break;
+		case 'a':
+			pin = true;
+			break;
+		case 'l': {
+			long len = strtol(optarg, NULL, 10);
+			if (len < 1) {
+				fprintf(stderr, "Max line length must be positive\n");
+				return -1;
+			}
+			max_line = (size_t) len;
+			break;
+		}
+		case 'j':
+			workers = strtol(optarg, NULL, 10);
+			if (workers < 1) {
+				fprintf(stderr, "Need at least one worker\n");
+				return -1;
+			}
+			break;
+		case 'w':
+			if (strcmp(optarg, "spin") == 0) {
+				channel_set_wait(CHANNEL_WAIT_SPIN);
+			} else if (strcmp(optarg, "hybrid") == 0) {
+				channel_set_wait(CHANNEL_WAIT_HYBRID);
+			} else if (strcmp(optarg, "park") == 0) {
+				channel_set_wait(CHANNEL_WAIT_PARK);
+			} else {
+				fprintf(stderr, "Unknown wait mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'm':
+			if ((max_memory = parse_size(optarg)) == 0) {
+				fprintf(stderr, "Bad memory size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'e':
+			if (strcmp(optarg, "auto") == 0) {
+				exec = EXEC_AUTO;
+			} else if (strcmp(optarg, "fused") == 0) {
+				exec = EXEC_FUSED;
+			} else if (strcmp(optarg, "threads") == 0) {
+				exec = EXEC_THREADS;
+			} else if (strcmp(optarg, "pool") == 0) {
+				exec = EXEC_POOL;
+			} else {
+				fprintf(stderr, "Unknown execution mode %s\n", optarg);
+				return -1;
+			}
+			break;
 		default:
 			usage(argv[0]);
 			return -1;
@@ -71,21 +199,77 @@ int main(int argc, char *argv[]) {
 		return -1;
 	}
 
+	// regular files get mapped, anything else is streamed through the cache
+	cache *stream = cache_init(128, fd);
+	if (!stream) {
+		fprintf(stderr, "Failed to set up input\n");
+		return MALLOCFAIL;
+	}
+
+	if (exec == EXEC_AUTO) {
+		size_t size = cache_mapped_size(stream);
+		exec = cpus == 1 || (size && size < FUSED_INPUT_MAX) ? EXEC_FUSED : EXEC_THREADS;
+	}
+	channel_set_fused(exec == EXEC_FUSED);
+	stage_set_pinning(pin && exec != EXEC_FUSED);
+	if (exec == EXEC_POOL && !stage_set_pool((size_t) workers)) {
+		fprintf(stderr, "Failed to start the worker pool, stages get threads of their own\n");
+	}
+
+	// split between the queues: tokens, unpacked, resolved and decoded tokens, lines, beautified lines
+	bool beautify = pretty || max_line;
+	channel_set_budget(max_memory / (2 + 3 * deobf + beautify));
+
 	// l is a list of tokens
-	List *l = tokenizer_start_thread (fd); // token list
+	Channel *l = tokenizer_start_thread (stream, (int) workers); // token list
 	if (deobf) {
-		l = decoder_creat_start_thread (l); // token list (deobfuscated)
+		l = unpacker_start_thread (l); // token list (packed scripts unpacked)
+		l = string_tables_start_thread (l); // token list (string tables resolved)
+		l = decoder_creat_start_thread (l, (int) workers); // token list (deobfuscated)
 	}
 
 	if (pretty) {
 		// l becomes a list of lines
 		l = lines_creat_start_thread (l); // makes basic lines
-		l = lines_beautify (l); // deeper beautification
 	} else {
 		l = ugly_lines_start_thread (l); // makes basic lines
 	}
-	printlines(l, stdout);
+	if (beautify) {
+		l = lines_beautify (l, max_line); // deeper beautification
+	}
+	printlines(l, STDOUT_FILENO, exec == EXEC_FUSED ? 1 : (int) workers);
+	stage_pool_stop();
+
+	if (stats) {
+		size_t live, peak;
+		arena_stats(&live, &peak);
+		fprintf(stderr, "token arena: %zu bytes peak, %zu bytes still live\n", peak, live);
+		token_block_stats(&live, &peak);
+		fprintf(stderr, "token blocks: %zu bytes peak, %zu bytes still live\n", peak, live);
+
+		// cpu time over all threads, waiting included
+		struct rusage ru;
+		getrusage(RUSAGE_SELF, &ru);
+		double cpu = ru.ru_utime.tv_sec + ru.ru_stime.tv_sec
+			+ (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+		size_t in = cache_mapped_size(stream) ? cache_mapped_size(stream) : cache_getcharnum(stream);
+		fprintf(stderr, "cpu: %.3f s, %.3f s/MB, %zu parked waits\n",
+			cpu, in ? cpu / (in / 1048576.0) : 0.0, channel_parks());
+		fprintf(stderr, "backpressure: %zu pushes waited on a full queue\n", channel_throttles());
+		if (exec == EXEC_POOL) {
+			fprintf(stderr, "pool: %ld workers, stages gave theirs up %zu times\n",
+				workers, channel_task_waits());
+		}
+		size_t pushes, items;
+		channel_handoffs(&pushes, &items);
+		fprintf(stderr, "handoff: %zu items in %zu pushes, %.1f per push\n",
+			items, pushes, pushes ? (double) items / pushes : 0.0);
+		unpacker_print_stats(stderr);
+		string_tables_print_stats(stderr);
+		decoder_print_stats(stderr);
+	}
 
+	cache_destroy(stream);
 	close(fd);
 	return 0;
 }
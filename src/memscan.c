@@ -0,0 +1,86 @@
+#include <stdint.h>
+#include "memscan.h"
+
+#if !defined(NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#define MEMSCAN_X86 1
+#include <immintrin.h>
+#endif
+
+typedef size_t (*memscan_fn)(const unsigned char *buf, size_t len, const unsigned char *set);
+
+static size_t memscan_scalar(const unsigned char *buf, size_t len, const unsigned char *set) {
+	size_t i;
+	for (i = 0; i < len; i++) {
+		unsigned char b = buf[i];
+		if (b == set[0] || b == set[1] || b == set[2] || b == set[3]) {
+			break;
+		}
+	}
+	return i;
+}
+
+#ifdef MEMSCAN_X86
+static size_t memscan_sse2(const unsigned char *buf, size_t len, const unsigned char *set) {
+	const __m128i s0 = _mm_set1_epi8((char) set[0]);
+	const __m128i s1 = _mm_set1_epi8((char) set[1]);
+	const __m128i s2 = _mm_set1_epi8((char) set[2]);
+	const __m128i s3 = _mm_set1_epi8((char) set[3]);
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + i));
+		__m128i m = _mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, s0), _mm_cmpeq_epi8(v, s1)),
+			_mm_or_si128(_mm_cmpeq_epi8(v, s2), _mm_cmpeq_epi8(v, s3)));
+		int mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + memscan_scalar(buf + i, len - i, set);
+}
+
+__attribute__((target("avx2")))
+static size_t memscan_avx2(const unsigned char *buf, size_t len, const unsigned char *set) {
+	const __m256i s0 = _mm256_set1_epi8((char) set[0]);
+	const __m256i s1 = _mm256_set1_epi8((char) set[1]);
+	const __m256i s2 = _mm256_set1_epi8((char) set[2]);
+	const __m256i s3 = _mm256_set1_epi8((char) set[3]);
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + i));
+		__m256i m = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, s0), _mm256_cmpeq_epi8(v, s1)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, s2), _mm256_cmpeq_epi8(v, s3)));
+		uint32_t mask = (uint32_t) _mm256_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
+		}
+	}
+	return i + memscan_sse2(buf + i, len - i, set);
+}
+#endif
+
+static size_t memscan_resolve(const unsigned char *buf, size_t len, const unsigned char *set);
+static memscan_fn memscan_impl = memscan_resolve;
+
+// first call picks the kernel for this cpu
+static size_t memscan_resolve(const unsigned char *buf, size_t len, const unsigned char *set) {
+	memscan_fn fn = memscan_scalar;
+#ifdef MEMSCAN_X86
+	__builtin_cpu_init();
+	fn = __builtin_cpu_supports("avx2") ? memscan_avx2 : memscan_sse2;
+#endif
+	__atomic_store_n(&memscan_impl, fn, __ATOMIC_RELAXED);
+	return fn(buf, len, set);
+}
+
+size_t memscan(const unsigned char *buf, size_t len, const char *set, int n) {
+	// pad the set out to 4 so the kernels don't care about n
+	unsigned char s[4];
+	int i;
+	for (i = 0; i < 4; i++) {
+		s[i] = (unsigned char) set[i < n ? i : 0];
+	}
+	memscan_fn fn = __atomic_load_n(&memscan_impl, __ATOMIC_RELAXED);
+	return fn(buf, len, s);
+}
@@ -0,0 +1,16 @@
+#ifndef _MEMSCANGUARD
+#define _MEMSCANGUARD 1
+#include <stddef.h>
+
+/*
+ * Vectorized byte searches. SSE2 is the baseline on x86, AVX2 is used when the
+ * cpu has it, everything else gets the scalar loop. Build with -DNO_SIMD to
+ * force the scalar loop.
+*/
+
+/*
+ * returns the index of the first byte in buf that is any of the first n (1 to
+ * 4) bytes of set, or len if there is none.
+*/
+size_t memscan(const unsigned char *buf, size_t len, const char *set, int n);
+#endif
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE // F_GETPIPE_SZ
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "output.h"
+
+#define OUTPUT_ALIGN     0x1000
+#define OUTPUT_FILE_SIZE 0x100000 // regular files and anything unknown
+#define OUTPUT_PIPE_SIZE 0x10000  // when the pipe's size can't be asked
+#define OUTPUT_TTY_SIZE  0x1000
+
+static const char tabs[OUTPUT_MAX_INDENT] = "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t";
+
+static size_t output_size(int fd, bool *tty) {
+	struct stat st;
+	*tty = isatty(fd);
+	if (*tty) {
+		return OUTPUT_TTY_SIZE;
+	}
+	if (fstat(fd, &st) == 0 && (S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode))) {
+		// a write that fills the pipe wakes the reader once, a bigger one blocks half done
+#ifdef F_GETPIPE_SZ
+		int size = fcntl(fd, F_GETPIPE_SZ);
+		if (size > 0) {
+			return (size_t) size;
+		}
+#endif
+		return OUTPUT_PIPE_SIZE;
+	}
+	return OUTPUT_FILE_SIZE;
+}
+
+Output *output_new(int fd) {
+	Output *o = (Output *) malloc(sizeof(Output));
+	if (!o) {
+		return NULL;
+	}
+	o->cap = output_size(fd, &o->line_buffered);
+	o->cap = (o->cap + OUTPUT_ALIGN - 1) & ~(size_t) (OUTPUT_ALIGN - 1);
+	if ((o->buf = (char *) aligned_alloc(OUTPUT_ALIGN, o->cap)) == NULL) {
+		free(o);
+		return NULL;
+	}
+	o->fd = fd;
+	o->len = 0;
+	o->failed = false;
+	return o;
+}
+
+Output *output_new_memory(size_t cap) {
+	Output *o = (Output *) malloc(sizeof(Output));
+	if (!o) {
+		return NULL;
+	}
+	if ((o->buf = (char *) malloc(cap)) == NULL) {
+		free(o);
+		return NULL;
+	}
+	o->fd = -1;
+	o->cap = cap;
+	o->len = 0;
+	o->line_buffered = false;
+	o->failed = false;
+	return o;
+}
+
+void output_reset(Output *o) {
+	o->len = 0;
+	o->failed = false;
+}
+
+static bool output_grow(Output *o, size_t len) {
+	size_t cap = o->cap;
+	while (cap < o->len + len) {
+		cap *= 2;
+	}
+	char *buf = (char *) realloc(o->buf, cap);
+	if (!buf) {
+		o->failed = true;
+		return false;
+	}
+	o->buf = buf;
+	o->cap = cap;
+	return true;
+}
+
+// writes all of iov, picking up after short writes
+static bool write_all(int fd, struct iovec *iov, int n) {
+	while (n > 0) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		size_t done = (size_t) w;
+		while (n > 0 && done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *) iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+	return true;
+}
+
+static bool output_write(Output *o, const char *data, size_t len) {
+	struct iovec iov[2] = {
+		{ .iov_base = o->buf, .iov_len = o->len },
+		{ .iov_base = (void *) data, .iov_len = len },
+	};
+	o->len = 0;
+	if (!o->failed && !write_all(o->fd, iov, len ? 2 : 1)) {
+		o->failed = true;
+	}
+	return !o->failed;
+}
+
+bool output_flush(Output *o) {
+	if (!o->len || o->fd < 0) {
+		return !o->failed;
+	}
+	return output_write(o, NULL, 0);
+}
+
+bool output_put(Output *o, const char *data, size_t len) {
+	if (o->len + len <= o->cap) {
+		memcpy(o->buf + o->len, data, len);
+		o->len += len;
+		return !o->failed;
+	}
+	if (o->fd < 0) {
+		if (!output_grow(o, len)) {
+			return false;
+		}
+		memcpy(o->buf + o->len, data, len);
+		o->len += len;
+		return true;
+	}
+	if (len >= o->cap / 2) {
+		// not worth copying, goes out with the buffer
+		return output_write(o, data, len);
+	}
+	if (!output_flush(o)) {
+		return false;
+	}
+	memcpy(o->buf, data, len);
+	o->len = len;
+	return true;
+}
+
+bool output_indent(Output *o, int count) {
+	if (count > OUTPUT_MAX_INDENT) {
+		count = OUTPUT_MAX_INDENT;
+	}
+	return output_put(o, tabs, count);
+}
+
+bool output_newline(Output *o) {
+	if (!output_put(o, "\n", 1)) {
+		return false;
+	}
+	return o->line_buffered ? output_flush(o) : true;
+}
+
+bool output_destroy(Output *o) {
+	bool ret = output_flush(o);
+	free(o->buf);
+	free(o);
+	return ret;
+}
@@ -0,0 +1,46 @@
+#ifndef _OUTPUTGUARD
+#define _OUTPUTGUARD 1
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Buffered writer straight to a file descriptor, no stdio. Bytes are
+ * gathered into one large buffer and written with a single call when it
+ * fills. Anything too big for the buffer goes out together with it in one
+ * writev, without being copied. The buffer is sized for what fd is: the
+ * pipe's capacity for pipes, large for files, and a line at a time for
+ * terminals.
+*/
+typedef struct {
+	int fd; // -1 keeps everything in buf
+	char *buf;
+	size_t len, cap;
+	bool line_buffered; // flush at every newline, for terminals
+	bool failed;
+} Output;
+
+// NULL if memory ran out
+Output *output_new(int fd);
+
+/*
+ * an Output that only collects, buf grows to hold whatever is put and
+ * output_reset empties it
+*/
+Output *output_new_memory(size_t cap);
+void output_reset(Output *o);
+
+bool output_put(Output *o, const char *data, size_t len);
+
+// count tabs, no more than OUTPUT_MAX_INDENT
+bool output_indent(Output *o, int count);
+
+bool output_newline(Output *o);
+
+// writes out everything buffered
+bool output_flush(Output *o);
+
+// flushes and frees, false if anything could not be written
+bool output_destroy(Output *o);
+
+#define OUTPUT_MAX_INDENT 16
+#endif
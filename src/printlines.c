@@ -2,71 +2,261 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "line_utils.h"
+#include "output.h"
+#include "stage.h"
 #include "printlines.h"
 
-static bool put_token(Token *tok, FILE *fp) {
-	if (fwrite(tok->value, sizeof(tok->value[0]), tok->length, fp) == tok->length) {
-		return true;
-	}
-	return false;
+static bool put_token(Token *tok, Output *out) {
+	return output_put(out, tok->value, tok->length);
 }
 
-static bool put_newline(FILE *fp) {
-	if (fputc('\n', fp) == EOF) {
-		return false;
-	}
-	return true;
+static bool put_newline(Output *out) {
+	return output_newline(out);
 }
 
-static bool put_indent(int count, FILE *fp) {
+static bool put_indent(int count, Output *out) {
 	if (count > 16) {
 		count = (count % 15) + 1;
 	}
-	int i;
-	for (i=0; i<count; i++) {
-		if (fputc('\t', fp) == EOF) {
+	return output_indent(out, count);
+}
+
+/*
+ * whitespace run with newlines in it, each newline starts a new line at the
+ * same indent. A newline that ends the last token is left for the line's own.
+*/
+static bool put_white_run(Token *tok, int indent, bool last, Output *out) {
+	const char *p = tok->value;
+	const char *end = p + tok->length;
+	while (p < end) {
+		const char *nl = memchr(p, '\n', end - p);
+		if (!nl) {
+			return output_put(out, p, end - p);
+		}
+		if (!output_put(out, p, nl - p)) {
+			return false;
+		}
+		p = nl + 1;
+		if ((p < end || !last) && (!put_newline(out) || !put_indent(indent, out))) {
 			return false;
 		}
 	}
 	return true;
 }
 
-static int print_one_line(List *tokens, int indent, FILE *fp) {
-	if (!put_indent(indent, fp)) {
+static int print_one_line(List *tokens, int indent, Output *out) {
+	if (!put_indent(indent, out)) {
 		return false;
 	}
 	Token *t;
 	while ((t = list_dequeue_block(tokens)) != NULL) {
-		bool ret = put_token(t, fp);
+		bool ret = t->newlines ? put_white_run(t, indent, list_length(tokens) == 0, out) : put_token(t, out);
 		tokens->free(t);
 		if (!ret) {
 			return false;
 		}
 	}
-	if (!put_newline(fp)) {
+	if (!put_newline(out)) {
 		return false;
 	}
 	return true;
 }
 
-bool printlines(List *lines, FILE *fp) {
+static bool print_serial(Channel *lines, Output *out) {
 	bool ret = true;
-	if (!lines) {
-		return false;
+	Line *l = NULL;
+	while (ret && (l = lines_channel_next(lines)) != NULL) {
+		ret = print_one_line(l->tokens, l->indent, out);
+		line_free(l);
 	}
+	return ret;
+}
 
-	Line *l = NULL;
-	while (ret && (l = list_dequeue_block(lines)) != NULL) {
-		ret = print_one_line(l->tokens, l->indent, fp);
-		lines->free(l);
+/*
+ * Parallel rendering. Blocks of lines are dealt out to workers in order,
+ * each renders a block into memory of its own and the blocks are written
+ * out in the order they came in. Only window blocks are out at a time, a
+ * finished one waits for those before it.
+*/
+#define RENDER_WINDOW  4 // blocks in flight per worker, bounds memory
+#define RENDER_BUFSIZE 0x4000
+
+typedef struct {
+	LineBlock *lines;
+	Output *out; // rendered block, kept by the slot
+	bool done;
+} Render_job;
+
+typedef struct {
+	Render_job *jobs; // ring of window slots
+	size_t window;
+	size_t added;   // blocks dealt out
+	size_t next;    // next block for a worker to pick up
+	size_t written; // blocks already written
+	bool halt;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Renderer;
+
+static void render_job(Render_job *j) {
+	LineBlock *b = j->lines;
+	output_reset(j->out);
+	for (; b->next < b->count; b->next++) {
+		Line *l = b->lines[b->next];
+		bool ok = print_one_line(l->tokens, l->indent, j->out);
+		line_free(l);
+		if (!ok) {
+			b->next++;
+			break;
+		}
 	}
-	list_destroy(lines);
+	line_block_free(b);
+	j->lines = NULL;
+}
 
-	if (!ret) {
-		fflush(fp);
-		fprintf(stderr, "Error while writing\n");
+static void *render_worker(void *in) {
+	Renderer *r = (Renderer *) in;
+	stage_pin_self();
+	pthread_mutex_lock(&r->lock);
+	for (;;) {
+		while (!r->halt && r->next == r->added) {
+			pthread_cond_wait(&r->cond, &r->lock);
+		}
+		if (r->next == r->added) {
+			break;
+		}
+		Render_job *j = &r->jobs[r->next++ % r->window];
+		pthread_mutex_unlock(&r->lock);
+
+		render_job(j);
+
+		pthread_mutex_lock(&r->lock);
+		j->done = true;
+		pthread_cond_broadcast(&r->cond);
 	}
+	pthread_mutex_unlock(&r->lock);
+	return NULL;
+}
 
+/*
+ * writes the oldest job once it is done, rendering it here if no worker
+ * got to it. Called with the lock held.
+*/
+static bool write_oldest(Renderer *r, Output *out) {
+	Render_job *j = &r->jobs[r->written % r->window];
+	if (r->next == r->written) {
+		r->next++;
+		pthread_mutex_unlock(&r->lock);
+		render_job(j);
+		pthread_mutex_lock(&r->lock);
+		j->done = true;
+	}
+	while (!j->done) {
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	pthread_mutex_unlock(&r->lock);
+	bool ret = !j->out->failed && output_put(out, j->out->buf, j->out->len);
+	pthread_mutex_lock(&r->lock);
+	r->written++;
 	return ret;
 }
+
+static bool print_parallel(Channel *lines, Output *out, int workers) {
+	Renderer r = {
+		.window = (size_t) workers * RENDER_WINDOW,
+	};
+	r.jobs = (Render_job *) calloc(r.window, sizeof(Render_job));
+	pthread_t *tids = (pthread_t *) malloc(workers * sizeof(pthread_t));
+	if (!r.jobs || !tids) {
+		free(r.jobs);
+		free(tids);
+		return print_serial(lines, out);
+	}
+	size_t i;
+	for (i = 0; i < r.window; i++) {
+		if ((r.jobs[i].out = output_new_memory(RENDER_BUFSIZE)) == NULL) {
+			while (i--) {
+				output_destroy(r.jobs[i].out);
+			}
+			free(r.jobs);
+			free(tids);
+			return print_serial(lines, out);
+		}
+	}
+
+	pthread_mutex_init(&r.lock, NULL);
+	pthread_cond_init(&r.cond, NULL);
+	int started = 0;
+	while (started < workers
+		&& pthread_create(&tids[started], NULL, render_worker, (void *) &r) == 0) {
+		started++;
+	}
+
+	bool ret = true;
+	LineBlock *b;
+	while (ret && (b = (LineBlock *) channel_pop_block(lines)) != NULL) {
+		pthread_mutex_lock(&r.lock);
+		while (ret && r.added - r.written == r.window) {
+			ret = write_oldest(&r, out);
+		}
+		if (!ret) {
+			pthread_mutex_unlock(&r.lock);
+			line_block_free(b);
+			break;
+		}
+		Render_job *j = &r.jobs[r.added++ % r.window];
+		j->lines = b;
+		j->done = false;
+		pthread_cond_broadcast(&r.cond);
+		// don't hold back what is ready
+		while (ret && r.written < r.next && r.jobs[r.written % r.window].done) {
+			ret = write_oldest(&r, out);
+		}
+		pthread_mutex_unlock(&r.lock);
+	}
+
+	pthread_mutex_lock(&r.lock);
+	while (r.written < r.added) {
+		// after a failure out writes nothing more, the rest is only freed
+		if (!write_oldest(&r, out)) {
+			ret = false;
+		}
+	}
+	r.halt = true;
+	pthread_cond_broadcast(&r.cond);
+	pthread_mutex_unlock(&r.lock);
+	while (started--) {
+		pthread_join(tids[started], NULL);
+	}
+	pthread_cond_destroy(&r.cond);
+	pthread_mutex_destroy(&r.lock);
+	for (i = 0; i < r.window; i++) {
+		output_destroy(r.jobs[i].out);
+	}
+	free(r.jobs);
+	free(tids);
+	return ret;
+}
+
+bool printlines(Channel *lines, int fd, int workers) {
+	if (!lines) {
+		return false;
+	}
+	Output *out = output_new(fd);
+	if (!out) {
+		channel_destroy(lines);
+		fprintf(stderr, "[!!] Failed to alloc\n");
+		return false;
+	}
+
+	bool ret = workers > 1 ? print_parallel(lines, out, workers) : print_serial(lines, out);
+	channel_destroy(lines);
+
+	if (!output_destroy(out) || !ret) {
+		fprintf(stderr, "Error while writing\n");
+		return false;
+	}
+	return true;
+}
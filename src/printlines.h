@@ -1,3 +1,7 @@
 #include <stdbool.h>
-#include "list.h"
-bool printlines(List *lines, FILE *fp);
+#include "channel.h"
+/*
+ * writes the lines to fd, false if it couldn't. More than one worker renders
+ * lines on that many threads, they are still written in order.
+*/
+bool printlines(Channel *lines, int fd, int workers);
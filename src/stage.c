@@ -0,0 +1,122 @@
+#define _GNU_SOURCE // sched_getaffinity, pthread_setaffinity_np
+#include <stdlib.h>
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "stage.h"
+#include "arena.h"
+
+typedef struct {
+	Channel *in, *out;
+	Stage_run run;
+	void *arg;
+} Stage;
+
+static bool pinning;
+static pthread_t *pool_tids;
+static size_t pool_size;
+static cpu_set_t cores; // the cores we may use, as they were before pinning anything
+static atomic_uint next_core;
+
+void stage_set_pinning(bool pin) {
+	pinning = pin && sched_getaffinity(0, sizeof(cores), &cores) == 0 && CPU_COUNT(&cores) > 1;
+}
+
+void stage_pin_self(void) {
+	if (!pinning) {
+		return;
+	}
+	unsigned int n = atomic_fetch_add_explicit(&next_core, 1, memory_order_relaxed) % CPU_COUNT(&cores);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &cores) && n-- == 0) {
+			cpu_set_t one;
+			CPU_ZERO(&one);
+			CPU_SET(cpu, &one);
+			pthread_setaffinity_np(pthread_self(), sizeof(one), &one);
+			return;
+		}
+	}
+}
+
+static void *stage_main(void *v) {
+	Stage s = *(Stage *) v;
+	free(v);
+	if (!pool_size) {
+		// pool workers pin themselves, stages move between them
+		stage_pin_self();
+	}
+	s.run(s.in, s.out, s.arg);
+	channel_destroy(s.in);
+	arena_thread_done();
+	channel_producer_fin(s.out);
+	return NULL;
+}
+
+static void *pool_main(void *unused) {
+	stage_pin_self();
+	channel_pool_work();
+	arena_thread_done();
+	return NULL;
+}
+
+bool stage_set_pool(size_t workers) {
+	if ((pool_tids = (pthread_t *) malloc(workers * sizeof(pthread_t))) == NULL) {
+		return false;
+	}
+	channel_set_pool(true);
+	for (pool_size = 0; pool_size < workers; pool_size++) {
+		if (pthread_create(&pool_tids[pool_size], NULL, pool_main, NULL) != 0) {
+			break;
+		}
+	}
+	if (!pool_size) {
+		// stages would never run
+		channel_set_pool(false);
+		free(pool_tids);
+		pool_tids = NULL;
+		return false;
+	}
+	return true;
+}
+
+void stage_pool_stop(void) {
+	if (!pool_size) {
+		return;
+	}
+	channel_pool_stop();
+	for (size_t k = 0; k < pool_size; k++) {
+		pthread_join(pool_tids[k], NULL);
+	}
+	free(pool_tids);
+	pool_tids = NULL;
+	pool_size = 0;
+	channel_set_pool(false);
+}
+
+Channel *stage_start(const char *name, Channel *in, Channel *out, Stage_run run, void *arg) {
+	if (!out) {
+		channel_destroy(in);
+		return NULL;
+	}
+	Stage *s = (Stage *) malloc(sizeof(Stage));
+	if (!s) {
+		channel_destroy(in);
+		channel_destroy(out);
+		return NULL;
+	}
+	s->in = in;
+	s->out = out;
+	s->run = run;
+	s->arg = arg;
+
+	if (!channel_start_thread(out, stage_main, (void *) s)) {
+		fprintf(stderr, "[!!] Failed to start the %s stage\n", name);
+		free(s);
+		channel_destroy(in);
+		channel_destroy(out);
+		return NULL;
+	}
+	return out;
+}
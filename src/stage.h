@@ -0,0 +1,43 @@
+#ifndef _STAGEGUARD
+#define _STAGEGUARD 1
+#include <stdbool.h>
+#include "channel.h"
+
+/*
+ * A pipeline stage reads one channel and writes another. run does the work
+ * and returns when its input is done or it can't go on, the framework does
+ * the rest: it runs the stage as the producer of out, on a thread of its
+ * own, as a task on the shared worker pool or fused onto the consumer's,
+ * and once run returns destroys in, hands back the stage's arena chunk and
+ * finishes out.
+*/
+typedef void (*Stage_run)(Channel *in, Channel *out, void *arg);
+
+/*
+ * starts run(in, out, arg) and returns out. in is NULL for a source stage.
+ * On failure in and out are destroyed and NULL is returned, arg is left to
+ * the caller.
+*/
+Channel *stage_start(const char *name, Channel *in, Channel *out, Stage_run run, void *arg);
+
+/*
+ * runs every stage started after this as a task on a pool of workers
+ * threads, however many stages there are, instead of a thread each. A
+ * stage keeps its worker until it waits on a channel. False if no worker
+ * could be started, stages then get threads of their own.
+*/
+bool stage_set_pool(size_t workers);
+
+// once the pipeline is done, ends the pool and joins its workers
+void stage_pool_stop(void);
+
+/*
+ * pins every stage thread or pool worker, and any worker that calls
+ * stage_pin_self, to a core of its own, round robin over the cores this
+ * process may use. Set before any stage starts.
+*/
+void stage_set_pinning(bool pin);
+
+// pins the calling thread to the next core when pinning is on
+void stage_pin_self(void);
+#endif
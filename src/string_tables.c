@@ -0,0 +1,663 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "string_tables.h"
+#include "stage.h"
+#include "token_block.h"
+
+/*
+ * Obfuscators move every string into one array, var _0xabc = ['...', ...],
+ * and read them back as _0xabc[0x1f], or through an accessor function,
+ * _0x12cd('0x1f'), that subtracts an offset and indexes the array. Tables
+ * are captured as their declaration streams past and each reference that
+ * follows is replaced by the string it reads.
+ *
+ * A table stops being resolved as soon as it is used any other way, like
+ * passed to the function that rotates it or assigned to, since its entries
+ * may have moved from then on.
+*/
+#define TABLES_HELD 4 // blocks a reference or accessor may span
+
+// a string literal of a table, as written
+typedef struct {
+	uint32_t offset; // into the table's bytes
+	uint32_t length;
+	uint8_t type;
+} Table_entry;
+
+typedef struct {
+	char *bytes;
+	size_t bytes_len, bytes_cap;
+	Table_entry *entries;
+	size_t len, cap;
+} String_table;
+
+// a table, or an accessor of one, by name
+typedef struct {
+	char *name; // NULL for a free slot
+	size_t len;
+	uint64_t hash;
+	String_table *table; // NULL once the table is used some other way
+	char *of;            // accessors: the table's name
+	size_t of_len;
+	long offset;         // accessors: subtracted from the index
+} Symbol;
+
+// where the declaration being captured is at
+typedef enum {
+	CAPTURE_ASSIGN,
+	CAPTURE_OPEN,
+	CAPTURE_VALUE,
+	CAPTURE_COMMA,
+} Capture_state;
+
+typedef struct {
+	Token_window win;
+	Token_writer w;
+	Symbol *symbols; // open addressing
+	size_t mask, count;
+	tokentype prev; // last solid token written
+	bool prev_delete; // and it was delete
+	// the table being declared
+	String_table *capture;
+	Symbol *capture_for;
+	Capture_state capture_at;
+} Tables;
+
+static size_t resolved, tables_found, entries_found;
+
+static void table_free(String_table *t) {
+	if (t) {
+		free(t->bytes);
+		free(t->entries);
+		free(t);
+	}
+}
+
+static bool table_add(String_table *t, const TokenBlock *b, uint32_t i) {
+	size_t len = b->length[i];
+	if (t->len == t->cap) {
+		size_t cap = t->cap ? t->cap * 2 : 256;
+		Table_entry *entries = (Table_entry *) realloc(t->entries, cap * sizeof(Table_entry));
+		if (!entries) {
+			return false;
+		}
+		t->entries = entries;
+		t->cap = cap;
+	}
+	if (t->bytes_len + len > t->bytes_cap) {
+		size_t cap = t->bytes_cap ? t->bytes_cap : 4096;
+		while (cap < t->bytes_len + len) {
+			cap *= 2;
+		}
+		char *bytes = cap > UINT32_MAX ? NULL : (char *) realloc(t->bytes, cap);
+		if (!bytes) {
+			return false;
+		}
+		t->bytes = bytes;
+		t->bytes_cap = cap;
+	}
+	memcpy(t->bytes + t->bytes_len, token_block_lexeme(b, i), len);
+	t->entries[t->len++] = (Table_entry) { t->bytes_len, len, b->type[i] };
+	t->bytes_len += len;
+	return true;
+}
+
+// FNV-1a, names are short
+static uint64_t name_hash(const char *s, size_t len) {
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t k = 0; k < len; k++) {
+		h = (h ^ (unsigned char) s[k]) * 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static Symbol *symbol_slot(Symbol *symbols, size_t mask, const char *s, size_t len, uint64_t hash) {
+	size_t k = hash & mask;
+	while (symbols[k].name && !(symbols[k].hash == hash && symbols[k].len == len
+		&& memcmp(symbols[k].name, s, len) == 0)) {
+		k = (k + 1) & mask;
+	}
+	return &symbols[k];
+}
+
+static Symbol *symbol_find(Tables *t, const char *s, size_t len) {
+	if (!t->count) {
+		return NULL;
+	}
+	Symbol *sym = symbol_slot(t->symbols, t->mask, s, len, name_hash(s, len));
+	return sym->name ? sym : NULL;
+}
+
+// the symbol called s, made if there is none. NULL if memory ran out
+static Symbol *symbol_add(Tables *t, const char *s, size_t len) {
+	if (2 * (t->count + 1) > t->mask + 1) {
+		size_t size = t->symbols ? 2 * (t->mask + 1) : 64;
+		Symbol *symbols = (Symbol *) calloc(size, sizeof(Symbol));
+		if (!symbols) {
+			return NULL;
+		}
+		for (size_t k = 0; t->symbols && k <= t->mask; k++) {
+			if (t->symbols[k].name) {
+				Symbol *to = symbol_slot(symbols, size - 1, t->symbols[k].name, t->symbols[k].len, t->symbols[k].hash);
+				*to = t->symbols[k];
+				if (t->capture_for == &t->symbols[k]) {
+					t->capture_for = to;
+				}
+			}
+		}
+		free(t->symbols);
+		t->symbols = symbols;
+		t->mask = size - 1;
+	}
+	uint64_t hash = name_hash(s, len);
+	Symbol *sym = symbol_slot(t->symbols, t->mask, s, len, hash);
+	if (!sym->name) {
+		if ((sym->name = (char *) malloc(len)) == NULL) {
+			return NULL;
+		}
+		memcpy(sym->name, s, len);
+		sym->len = len;
+		sym->hash = hash;
+		t->count++;
+	}
+	return sym;
+}
+
+// the symbol stops being resolved
+static void symbol_drop(Symbol *sym) {
+	table_free(sym->table);
+	free(sym->of);
+	sym->table = NULL;
+	sym->of = NULL;
+}
+
+static void symbols_free(Tables *t) {
+	for (size_t k = 0; t->symbols && k <= t->mask; k++) {
+		if (t->symbols[k].name) {
+			symbol_drop(&t->symbols[k]);
+			free(t->symbols[k].name);
+		}
+	}
+	free(t->symbols);
+}
+
+static inline bool is_quoted(tokentype t) {
+	return t == TOKEN_SINGLE_QUOTE_STRING || t == TOKEN_DOUBLE_QUOTE_STRING;
+}
+
+static inline bool is_declaration(tokentype t) {
+	return t == TOKEN_VAR || t == TOKEN_LET || t == TOKEN_CONST;
+}
+
+static inline bool is_assignment(tokentype t) {
+	switch (t) {
+	case TOKEN_ASSIGN:
+	case TOKEN_PLUS_EQUAL:
+	case TOKEN_MINUS_ASSIGN:
+	case TOKEN_MULTIPLY_ASSIGN:
+	case TOKEN_DIVIDE_ASSIGN:
+	case TOKEN_MOD_ASSIGN:
+	case TOKEN_BITWISE_OR_ASSIGN:
+	case TOKEN_BITWISE_AND_ASSIGN:
+	case TOKEN_BITWISE_XOR_ASSIGN:
+	case TOKEN_BITSHIFT_LEFT_ASSIGN:
+	case TOKEN_BITSHIFT_RIGHT_ASSIGN:
+	case TOKEN_INCREMENT:
+	case TOKEN_DECREMENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool is_word(const TokenBlock *b, uint32_t i, const char *word) {
+	size_t len = strlen(word);
+	return b->length[i] == len && memcmp(token_block_lexeme(b, i), word, len) == 0;
+}
+
+static bool same_name(const TokenBlock *a, uint32_t i, const TokenBlock *b, uint32_t j) {
+	return a->length[i] == b->length[j]
+		&& memcmp(token_block_lexeme(a, i), token_block_lexeme(b, j), a->length[i]) == 0;
+}
+
+// an index as the obfuscator writes it, 0x1f or 31
+static bool parse_index(const char *s, size_t len, long *v) {
+	int base = 10;
+	if (len > 2 && s[0] == '0' && (s[1] | 0x20) == 'x') {
+		base = 16;
+		s += 2;
+		len -= 2;
+	}
+	if (!len || len > 15) {
+		return false;
+	}
+	*v = 0;
+	for (size_t k = 0; k < len; k++) {
+		char c = s[k] | 0x20;
+		int d = c >= '0' && c <= '9' ? c - '0' : base == 16 && c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+		if (d < 0) {
+			return false;
+		}
+		*v = *v * base + d;
+	}
+	return true;
+}
+
+static bool token_index(const TokenBlock *b, uint32_t i, long *v) {
+	const char *s = token_block_lexeme(b, i);
+	if (b->type[i] == TOKEN_NUMERIC) {
+		return parse_index(s, b->length[i], v);
+	}
+	return is_quoted(b->type[i]) && parse_index(s + 1, b->length[i] - 2, v);
+}
+
+// writes every token from the window's next one up to p
+static bool copy_to(Tables *t, Token_pos p) {
+	bool status = true;
+	for (size_t k = 0; status && k <= p.k; k++) {
+		TokenBlock *b = t->win.held[k].b;
+		uint32_t end = k == p.k ? p.i : b->count;
+		for (uint32_t i = b->next; status && i < end; i++) {
+			status = token_writer_copy(&t->w, b, i);
+		}
+	}
+	return status;
+}
+
+/*
+ * the rest of an accessor from its parameter list on:
+ * (i, ...) { i = i - offset; var s = table[i]; return s; }
+*/
+static void accessor(Tables *t, Token_pos p, const TokenBlock *nb, uint32_t ni) {
+	TokenBlock *b, *ib, *sb;
+	uint32_t i, ii, si;
+	Token_window *win = &t->win;
+	if (token_window_next_solid(win, &p, &b, &i) != TOKEN_OPEN_PAREN
+		|| token_window_next_solid(win, &p, &ib, &ii) != TOKEN_VARIABLE) {
+		return;
+	}
+	tokentype type;
+	while ((type = token_window_next_solid(win, &p, &b, &i)) == TOKEN_COMMA) {
+		if (token_window_next_solid(win, &p, &b, &i) != TOKEN_VARIABLE) {
+			return;
+		}
+	}
+	long offset;
+	if (type != TOKEN_CLOSE_PAREN
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_OPEN_CURLY
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_VARIABLE || !same_name(b, i, ib, ii)
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_ASSIGN
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_VARIABLE || !same_name(b, i, ib, ii)
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_SUBTRACT
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_NUMERIC || !token_index(b, i, &offset)
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_SEMICOLON
+		|| !is_declaration(token_window_next_solid(win, &p, &b, &i))
+		|| token_window_next_solid(win, &p, &sb, &si) != TOKEN_VARIABLE
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_ASSIGN) {
+		return;
+	}
+	TokenBlock *tb;
+	uint32_t ti;
+	if (token_window_next_solid(win, &p, &tb, &ti) != TOKEN_VARIABLE
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_OPEN_BRACE
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_VARIABLE || !same_name(b, i, ib, ii)
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_CLOSE_BRACE
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_SEMICOLON
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_RETURN
+		|| token_window_next_solid(win, &p, &b, &i) != TOKEN_VARIABLE || !same_name(b, i, sb, si)) {
+		return;
+	}
+	if ((type = token_window_next_solid(win, &p, &b, &i)) == TOKEN_SEMICOLON) {
+		type = token_window_next_solid(win, &p, &b, &i);
+	}
+	if (type != TOKEN_CLOSE_CURLY) {
+		return;
+	}
+	// before the table is looked up, adding may move it
+	Symbol *sym = symbol_add(t, token_block_lexeme(nb, ni), nb->length[ni]);
+	Symbol *table = symbol_find(t, token_block_lexeme(tb, ti), tb->length[ti]);
+	if (!sym || !table || !table->table || sym == table) {
+		return;
+	}
+	free(sym->of);
+	if ((sym->of = (char *) malloc(table->len)) != NULL) {
+		memcpy(sym->of, table->name, table->len);
+		sym->of_len = table->len;
+		sym->offset = offset;
+	}
+}
+
+/*
+ * at var, let or const: a table or an accessor being declared. When it is a
+ * table everything up to and including the name is written and *done set.
+*/
+static bool declaration(Tables *t, bool *done) {
+	Token_pos p = { 0, t->win.held[0].b->next + 1 };
+	TokenBlock *nb, *b;
+	uint32_t ni, i;
+	*done = false;
+	if (token_window_next_solid(&t->win, &p, &nb, &ni) != TOKEN_VARIABLE) {
+		return true;
+	}
+	Token_pos after_name = p;
+	if (token_window_next_solid(&t->win, &p, &b, &i) != TOKEN_ASSIGN) {
+		return true;
+	}
+	Symbol *sym = symbol_find(t, token_block_lexeme(nb, ni), nb->length[ni]);
+	switch (token_window_next_solid(&t->win, &p, &b, &i)) {
+	case TOKEN_OPEN_BRACE:
+		if (!sym && (sym = symbol_add(t, token_block_lexeme(nb, ni), nb->length[ni])) == NULL) {
+			return true;
+		}
+		table_free(t->capture);
+		if ((t->capture = (String_table *) calloc(1, sizeof(String_table))) == NULL) {
+			return true;
+		}
+		t->capture_for = sym;
+		t->capture_at = CAPTURE_ASSIGN;
+		symbol_drop(sym);
+		// from here on the capture takes the tokens as they are written
+		*done = true;
+		t->prev = TOKEN_VARIABLE;
+		t->prev_delete = false;
+		if (!copy_to(t, after_name)) {
+			return false;
+		}
+		token_window_seek(&t->win, after_name);
+		return true;
+	case TOKEN_FUNCTION:
+		if (sym) {
+			symbol_drop(sym);
+		}
+		accessor(t, p, nb, ni);
+		return true;
+	default:
+		if (sym) {
+			symbol_drop(sym);
+		}
+		return true;
+	}
+}
+
+// at function: an accessor being declared
+static void function(Tables *t) {
+	Token_pos p = { 0, t->win.held[0].b->next + 1 };
+	TokenBlock *nb;
+	uint32_t ni;
+	if (token_window_next_solid(&t->win, &p, &nb, &ni) == TOKEN_VARIABLE) {
+		Symbol *sym = symbol_find(t, token_block_lexeme(nb, ni), nb->length[ni]);
+		if (!sym || !sym->table) {
+			accessor(t, p, nb, ni);
+		}
+	}
+}
+
+/*
+ * whether the ] at the window's next token ends the declaration. Anything
+ * else, ['a', 'b'].reverse() or [...][k], means the variable isn't the
+ * array as written.
+*/
+static bool table_ends(Tables *t) {
+	Token_pos p = { 0, t->win.held[0].b->next + 1 };
+	TokenBlock *b;
+	uint32_t i;
+	switch (token_window_next_solid(&t->win, &p, &b, &i)) {
+	case TOKEN_SEMICOLON:
+	case TOKEN_COMMA:
+	case TOKEN_CLOSE_CURLY:
+	case TOKEN_EOF:
+		return true;
+	case TOKEN_STOP:
+		// the end of the input, unless the window ran out
+		return t->win.in_done;
+	default:
+		return false;
+	}
+}
+
+// the declaration being captured takes the next solid token
+static void capture(Tables *t, const TokenBlock *b, uint32_t i) {
+	tokentype type = b->type[i];
+	switch (t->capture_at) {
+	case CAPTURE_ASSIGN:
+		if (type == TOKEN_ASSIGN) {
+			t->capture_at = CAPTURE_OPEN;
+			return;
+		}
+		break;
+	case CAPTURE_OPEN:
+		if (type == TOKEN_OPEN_BRACE) {
+			t->capture_at = CAPTURE_VALUE;
+			return;
+		}
+		break;
+	case CAPTURE_VALUE:
+		if (is_quoted(type) && table_add(t->capture, b, i)) {
+			t->capture_at = CAPTURE_COMMA;
+			return;
+		}
+		break;
+	case CAPTURE_COMMA:
+		if (type == TOKEN_COMMA) {
+			t->capture_at = CAPTURE_VALUE;
+			return;
+		}
+		break;
+	}
+	if (type == TOKEN_CLOSE_BRACE && t->capture_at >= CAPTURE_VALUE && t->capture->len && table_ends(t)) {
+		t->capture_for->table = t->capture;
+		tables_found++;
+		entries_found += t->capture->len;
+		t->capture = NULL;
+		return;
+	}
+	table_free(t->capture);
+	t->capture = NULL;
+}
+
+static bool put_entry(Tables *t, const TokenBlock *b, uint32_t i, const String_table *table, long index) {
+	const Table_entry *e = &table->entries[index];
+	Token tok = {
+		.value = table->bytes + e->offset,
+		.length = e->length,
+		.type = e->type,
+	};
+	resolved++;
+	t->prev = e->type;
+	t->prev_delete = false;
+	return token_writer_put(&t->w, &tok, b->pos_base + b->pos[i]);
+}
+
+// moves p past the ] of an index, false if the window runs out first
+static bool skip_index(Tables *t, Token_pos *p) {
+	TokenBlock *b;
+	uint32_t i;
+	int depth = 1;
+	while (depth) {
+		switch (token_window_next_solid(&t->win, p, &b, &i)) {
+		case TOKEN_OPEN_BRACE:
+			depth++;
+			break;
+		case TOKEN_CLOSE_BRACE:
+			depth--;
+			break;
+		case TOKEN_STOP:
+			return false;
+		default:
+			break;
+		}
+	}
+	return true;
+}
+
+/*
+ * at a table or accessor name: a reference is replaced by its string, any
+ * other use of a table stops it being resolved. True with *done set when
+ * the name was dealt with.
+*/
+static bool reference(Tables *t, Symbol *sym, bool *done) {
+	TokenBlock *nb = t->win.held[0].b;
+	uint32_t ni = nb->next;
+	Token_pos p = { 0, ni + 1 };
+	TokenBlock *b, *ib;
+	uint32_t i, ii;
+	long index;
+	*done = false;
+	if (sym->table) {
+		if (t->prev_delete || t->prev == TOKEN_INCREMENT || t->prev == TOKEN_DECREMENT) {
+			symbol_drop(sym);
+			return true;
+		}
+		switch (token_window_next_solid(&t->win, &p, &b, &i)) {
+		case TOKEN_OPEN_BRACE: {
+			Token_pos in = p;
+			bool literal = false;
+			switch (token_window_next_solid(&t->win, &p, &ib, &ii)) {
+			case TOKEN_NUMERIC:
+				literal = token_window_next_solid(&t->win, &p, &b, &i) == TOKEN_CLOSE_BRACE;
+				break;
+			case TOKEN_VARIABLE:
+			case TOKEN_STOP:
+				break;
+			default:
+				symbol_drop(sym);
+				return true;
+			}
+			// an index like [k] or [0x1 + k] is only read past, and written through
+			if (!literal) {
+				p = in;
+				if (!skip_index(t, &p)) {
+					symbol_drop(sym);
+					return true;
+				}
+			}
+			Token_pos after = p;
+			tokentype next = token_window_next_solid(&t->win, &p, &b, &i);
+			if (is_assignment(next) || (next == TOKEN_STOP && !t->win.in_done)) {
+				// written to, or can't tell as the window ran out
+				symbol_drop(sym);
+				return true;
+			}
+			if (!literal || !token_index(ib, ii, &index) || (size_t) index >= sym->table->len) {
+				return true;
+			}
+			*done = true;
+			bool status = put_entry(t, nb, ni, sym->table, index);
+			token_window_seek(&t->win, after);
+			return status;
+		}
+		case TOKEN_DOT:
+			// a method call on it, like the rotation's push(shift())
+		default:
+			symbol_drop(sym);
+			return true;
+		case TOKEN_STOP:
+			return true;
+		}
+	}
+	if (!sym->of) {
+		return true;
+	}
+	Symbol *table = symbol_find(t, sym->of, sym->of_len);
+	if (!table || !table->table
+		|| token_window_next_solid(&t->win, &p, &b, &i) != TOKEN_OPEN_PAREN) {
+		return true;
+	}
+	tokentype type = token_window_next_solid(&t->win, &p, &ib, &ii);
+	if ((type != TOKEN_NUMERIC && !is_quoted(type)) || !token_index(ib, ii, &index)
+		|| token_window_next_solid(&t->win, &p, &b, &i) != TOKEN_CLOSE_PAREN) {
+		return true;
+	}
+	index -= sym->offset;
+	if (index < 0 || (size_t) index >= table->table->len) {
+		return true;
+	}
+	*done = true;
+	bool status = put_entry(t, nb, ni, table->table, index);
+	token_window_seek(&t->win, p);
+	return status;
+}
+
+static void string_tables(Channel *in, Channel *out, void *arg) {
+	Tables t = { .prev = TOKEN_NONE };
+	token_window_init(&t.win, in, TABLES_HELD);
+	token_writer_init(&t.w, out, NULL);
+	bool status = true;
+	TokenBlock *b;
+	while (status && (b = token_window_block(&t.win, 0)) != NULL) {
+		if (b->next == b->count) {
+			token_window_drop(&t.win);
+			continue;
+		}
+		uint32_t i = b->next;
+		tokentype type = b->type[i];
+		switch (type) {
+		case TOKEN_TAB:
+		case TOKEN_SPACE:
+		case TOKEN_NEWLINE:
+		case TOKEN_CARRAGE_RETURN:
+		case TOKEN_LINE_COMMENT:
+		case TOKEN_MULTI_LINE_COMMENT:
+			b->next++;
+			status = token_writer_copy(&t.w, b, i);
+			continue;
+		case TOKEN_VAR:
+		case TOKEN_LET:
+		case TOKEN_CONST:
+			if (!t.capture) {
+				bool done;
+				status = declaration(&t, &done);
+				if (done) {
+					continue;
+				}
+			}
+			break;
+		case TOKEN_FUNCTION:
+			if (!t.capture) {
+				function(&t);
+			}
+			break;
+		case TOKEN_VARIABLE:
+			if (t.count && t.prev != TOKEN_DOT && !t.capture) {
+				Symbol *sym = symbol_find(&t, token_block_lexeme(b, i), b->length[i]);
+				bool done = false;
+				if (sym) {
+					status = reference(&t, sym, &done);
+				}
+				if (done) {
+					continue;
+				}
+			}
+			break;
+		default:
+			break;
+		}
+		if (t.capture) {
+			capture(&t, b, i);
+		}
+		t.prev = type;
+		t.prev_delete = type == TOKEN_VARIABLE && is_word(b, i, "delete");
+		b->next++;
+		status = status && token_writer_copy(&t.w, b, i);
+	}
+	table_free(t.capture);
+	symbols_free(&t);
+	token_window_free(&t.win);
+	token_writer_flush(&t.w);
+}
+
+Channel *string_tables_start_thread(Channel *tokens) {
+	if (!tokens) {
+		return NULL;
+	}
+	Channel *out = token_stream_new(channel_capacity(TOKEN_BLOCK_FOOTPRINT, TOKEN_STREAM_BLOCKS));
+	return stage_start("string tables", tokens, out, string_tables, NULL);
+}
+
+void string_tables_print_stats(FILE *f) {
+	if (tables_found) {
+		fprintf(f, "string tables: %zu references resolved from %zu tables of %zu strings\n",
+			resolved, tables_found, entries_found);
+	}
+}
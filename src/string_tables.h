@@ -0,0 +1,14 @@
+#ifndef _STRINGTABLESGUARD
+#define _STRINGTABLESGUARD 1
+#include <stdio.h>
+#include "channel.h"
+/*
+ * consumer of tokens, producer of tokens with references into obfuscator
+ * string tables, _0xabc[0x1f] or an accessor call _0x12cd('0x1f'), replaced
+ * by the strings they read
+*/
+Channel *string_tables_start_thread(Channel *tokens);
+
+// references resolved over the last run, nothing if no table was found
+void string_tables_print_stats(FILE *f);
+#endif
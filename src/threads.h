@@ -1,4 +0,0 @@
-typedef struct Thread_params {
-	void *input;
-	void *output;
-} Thread_params;
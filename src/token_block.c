@@ -0,0 +1,361 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "token_block.h"
+#include "arena.h"
+
+static atomic_size_t bytes_live;
+static atomic_size_t bytes_peak;
+
+static void stats_add(size_t size) {
+	size_t now = atomic_fetch_add_explicit(&bytes_live, size, memory_order_relaxed) + size;
+	size_t peak = atomic_load_explicit(&bytes_peak, memory_order_relaxed);
+	while (now > peak && !atomic_compare_exchange_weak_explicit(&bytes_peak, &peak, now,
+		memory_order_relaxed, memory_order_relaxed));
+}
+
+static void stats_sub(size_t size) {
+	atomic_fetch_sub_explicit(&bytes_live, size, memory_order_relaxed);
+}
+
+void token_block_stats(size_t *live, size_t *peak) {
+	*live = atomic_load_explicit(&bytes_live, memory_order_relaxed);
+	*peak = atomic_load_explicit(&bytes_peak, memory_order_relaxed);
+}
+
+static TokenBlock *block_new(const char *map, size_t pos_base) {
+	TokenBlock *b = (TokenBlock *) malloc(sizeof(TokenBlock));
+	if (!b) {
+		return NULL;
+	}
+	b->pos_base = pos_base;
+	b->map = map;
+	b->bytes = NULL;
+	b->bytes_len = b->bytes_cap = 0;
+	b->count = b->next = 0;
+	stats_add(sizeof(TokenBlock));
+	return b;
+}
+
+void token_block_free(void *v) {
+	TokenBlock *b = (TokenBlock *) v;
+	if (b) {
+		stats_sub(sizeof(TokenBlock) + b->bytes_cap);
+		free(b->bytes);
+		free(b);
+	}
+}
+
+Channel *token_stream_new(size_t blocks) {
+	return channel_new(&token_block_free, blocks);
+}
+
+static bool block_reserve(TokenBlock *b, size_t len) {
+	if (b->bytes_len + len <= b->bytes_cap) {
+		return true;
+	}
+	size_t cap = b->bytes_cap ? b->bytes_cap : 256;
+	while (cap < b->bytes_len + len) {
+		cap *= 2;
+	}
+	char *bytes = (char *) realloc(b->bytes, cap);
+	if (!bytes) {
+		return false;
+	}
+	stats_add(cap - b->bytes_cap);
+	b->bytes = bytes;
+	b->bytes_cap = cap;
+	return true;
+}
+
+void token_writer_init(Token_writer *w, Channel *out, const char *map) {
+	w->out = out;
+	w->block = NULL;
+	w->map = map;
+}
+
+bool token_writer_flush(Token_writer *w) {
+	TokenBlock *b = w->block;
+	w->block = NULL;
+	if (!b) {
+		return true;
+	}
+	if (b->count == 0) {
+		token_block_free(b);
+		return true;
+	}
+	return channel_push_batch(w->out, b, b->count);
+}
+
+/*
+ * returns the block the next token goes in, handing on the current one if
+ * it can't take a token at charnum with len more bytes
+*/
+static TokenBlock *writer_block(Token_writer *w, size_t charnum, size_t len) {
+	TokenBlock *b = w->block;
+	if (b && (b->count == TOKEN_BLOCK_CAP
+		|| charnum - b->pos_base > UINT32_MAX
+		|| (len && b->bytes_len + len > TOKEN_BLOCK_BYTES && b->bytes_len))) {
+		if (!token_writer_flush(w)) {
+			return NULL;
+		}
+		b = NULL;
+	}
+	if (!b) {
+		b = w->block = block_new(w->map, charnum);
+		if (!b) {
+			channel_status_set_flag(w->out, LIST_MEMFAIL);
+		}
+	}
+	return b;
+}
+
+/*
+ * appends an entry, bytes is copied in when not NULL
+*/
+static bool writer_add(Token_writer *w, tokentype type, unsigned int flags,
+	size_t charnum, size_t length, const char *bytes, size_t offset) {
+	if (length > UINT32_MAX) {
+		fprintf(stderr, "Token at char position %zu is too long\n", charnum);
+		channel_status_set_flag(w->out, LIST_MEMFAIL);
+		return false;
+	}
+	TokenBlock *b = writer_block(w, charnum, bytes ? length : 0);
+	if (!b) {
+		return false;
+	}
+	if (bytes) {
+		if (!block_reserve(b, length)) {
+			channel_status_set_flag(w->out, LIST_MEMFAIL);
+			return false;
+		}
+		memcpy(b->bytes + b->bytes_len, bytes, length);
+		offset = b->bytes_len;
+		b->bytes_len += length;
+		flags |= TOKEN_OWN;
+	}
+	uint32_t i = b->count++;
+	b->type[i] = type;
+	b->flags[i] = flags;
+	b->offset[i] = offset;
+	b->length[i] = length;
+	b->pos[i] = charnum - b->pos_base;
+	return true;
+}
+
+static inline bool is_fixed(tokentype type, size_t length) {
+	return token_fixed[type].value && token_fixed[type].length == length;
+}
+
+bool token_writer_put(Token_writer *w, const Token *tok, size_t charnum) {
+	const char *bytes = NULL;
+	if (is_fixed(tok->type, tok->length)) {
+		// spelled out by its type
+	} else if (w->map && tok->value == w->map + charnum) {
+		// still in the mapping
+	} else {
+		bytes = tok->value;
+	}
+	return writer_add(w, tok->type, tok->flags, charnum, tok->length, bytes, 0);
+}
+
+bool token_writer_copy(Token_writer *w, const TokenBlock *b, size_t i) {
+	size_t charnum = b->pos_base + b->pos[i];
+	const char *bytes = NULL;
+	if (b->flags[i] & TOKEN_OWN) {
+		bytes = b->bytes + b->offset[i];
+	} else if (!w->map) {
+		// streams that don't know the mapping take it from their input
+		w->map = b->map;
+		if (w->block) {
+			w->block->map = w->map;
+		}
+	}
+	return writer_add(w, b->type[i], b->flags[i] & ~TOKEN_OWN, charnum, b->length[i], bytes, b->offset[i]);
+}
+
+Token *token_block_get(const TokenBlock *b, size_t i) {
+	tokentype type = b->type[i];
+	size_t length = b->length[i];
+	if (is_fixed(type, length)) {
+		return (Token *) &token_fixed[type];
+	}
+
+	bool own = b->flags[i] & TOKEN_OWN;
+	// lexemes in the block go with the token, the block is freed long before
+	Token *tok = (Token *) arena_alloc(sizeof(Token) + (own ? length + 1 : 0));
+	if (!tok) {
+		return NULL;
+	}
+	tok->charnum = b->pos_base + b->pos[i];
+	if (own) {
+		char *copy = (char *) (tok + 1);
+		memcpy(copy, b->bytes + b->offset[i], length);
+		tok->value = copy;
+	} else {
+		tok->value = b->map + tok->charnum;
+	}
+	tok->length = length;
+	tok->type = type;
+	tok->flags = b->flags[i] & ~TOKEN_OWN;
+	switch (type) {
+	case TOKEN_TAB:
+	case TOKEN_SPACE:
+	case TOKEN_NEWLINE:
+	case TOKEN_CARRAGE_RETURN:
+		for (size_t j = 0; j < length; j++) {
+			tok->newlines += tok->value[j] == '\n';
+		}
+		break;
+	default:
+		break;
+	}
+	return tok;
+}
+
+const char *token_block_lexeme(const TokenBlock *b, size_t i) {
+	if (is_fixed(b->type[i], b->length[i])) {
+		return token_fixed[b->type[i]].value;
+	}
+	if (b->flags[i] & TOKEN_OWN) {
+		return b->bytes + b->offset[i];
+	}
+	return b->map + b->pos_base + b->pos[i];
+}
+
+TokenBlock *token_stream_head(Channel *tl) {
+	TokenBlock *b;
+	while ((b = (TokenBlock *) channel_peek_block(tl)) != NULL) {
+		if (b->next < b->count) {
+			return b;
+		}
+		channel_drop_head(tl);
+	}
+	return NULL;
+}
+
+void token_window_init(Token_window *win, Channel *in, size_t max) {
+	*win = (Token_window) { .in = in, .max = max };
+}
+
+void token_window_free(Token_window *win) {
+	while (win->len) {
+		token_window_drop(win);
+	}
+	free(win->held);
+	win->held = NULL;
+	win->cap = 0;
+}
+
+bool token_window_insert(Token_window *win, size_t k, TokenBlock *b, int tag) {
+	if (win->len == win->cap) {
+		size_t cap = win->cap ? win->cap * 2 : 8;
+		Token_held *held = (Token_held *) realloc(win->held, cap * sizeof(Token_held));
+		if (!held) {
+			return false;
+		}
+		win->held = held;
+		win->cap = cap;
+	}
+	memmove(win->held + k + 1, win->held + k, (win->len - k) * sizeof(Token_held));
+	win->held[k] = (Token_held) { b, tag };
+	win->len++;
+	return true;
+}
+
+void token_window_drop(Token_window *win) {
+	token_block_free(win->held[0].b);
+	memmove(win->held, win->held + 1, --win->len * sizeof(Token_held));
+}
+
+TokenBlock *token_window_block(Token_window *win, size_t k) {
+	while (k >= win->len) {
+		TokenBlock *b;
+		if (win->in_done || win->len >= win->max) {
+			return NULL;
+		}
+		if ((b = (TokenBlock *) channel_pop_block(win->in)) == NULL) {
+			win->in_done = true;
+			return NULL;
+		}
+		if (!token_window_insert(win, win->len, b, 0)) {
+			token_block_free(b);
+			return NULL;
+		}
+	}
+	return win->held[k].b;
+}
+
+static inline bool is_filler(tokentype t) {
+	switch (t) {
+	case TOKEN_TAB:
+	case TOKEN_SPACE:
+	case TOKEN_NEWLINE:
+	case TOKEN_CARRAGE_RETURN:
+	case TOKEN_LINE_COMMENT:
+	case TOKEN_MULTI_LINE_COMMENT:
+		return true;
+	default:
+		return false;
+	}
+}
+
+tokentype token_window_next_solid(Token_window *win, Token_pos *p, TokenBlock **b, uint32_t *i) {
+	TokenBlock *blk;
+	while ((blk = token_window_block(win, p->k)) != NULL) {
+		if (p->i >= blk->count) {
+			p->k++;
+			p->i = 0;
+			continue;
+		}
+		uint32_t at = p->i++;
+		if (!is_filler(blk->type[at])) {
+			*b = blk;
+			*i = at;
+			return blk->type[at];
+		}
+	}
+	return TOKEN_STOP;
+}
+
+void token_window_seek(Token_window *win, Token_pos p) {
+	while (p.k--) {
+		token_window_drop(win);
+	}
+	win->held[0].b->next = p.i;
+}
+
+Token * token_list_dequeue(Channel *tl) {
+	TokenBlock *b = token_stream_head(tl);
+	if (!b) {
+		return NULL;
+	}
+	return token_block_get(b, b->next++);
+}
+
+tokentype token_list_peek_type(Channel *tl) {
+	TokenBlock *b = token_stream_head(tl);
+	if (b) {
+		return b->type[b->next];
+	}
+	return TOKEN_ERROR;
+}
+
+tokentype token_list_consume_white_peek(Channel *tl) {
+	TokenBlock *b;
+	while ((b = token_stream_head(tl)) != NULL) {
+		switch (b->type[b->next]) {
+		case TOKEN_SPACE:
+		case TOKEN_NEWLINE:
+		case TOKEN_CARRAGE_RETURN:
+		case TOKEN_TAB:
+			b->next++;
+			break;
+		default:
+			return b->type[b->next];
+		}
+	}
+	return TOKEN_STOP;
+}
@@ -0,0 +1,155 @@
+#ifndef _TOKENBLOCKGUARD
+#define _TOKENBLOCKGUARD 1
+#include <stdint.h>
+#include "channel.h"
+#include "tokenizer.h"
+
+/*
+ * Tokens travel between stages packed into blocks, one list element per
+ * block. A token is 14 bytes spread over parallel arrays instead of a Token
+ * and a list element of its own. Token structs are only made when a consumer
+ * dequeues one, and fixed lexemes never are, they come back as flyweights.
+*/
+#define TOKEN_BLOCK_CAP   1024
+#define TOKEN_BLOCK_BYTES 0x10000 // soft limit on lexeme bytes copied into a block
+
+#define TOKEN_OWN (1 << 7) // block flag, the lexeme is in bytes, not the input mapping
+
+typedef struct token_block {
+	size_t pos_base;       // charnum of the first token
+	const char *map;       // input mapping, NULL when streamed
+	char *bytes;           // lexemes that aren't in the mapping
+	size_t bytes_len, bytes_cap;
+	uint32_t count;        // tokens in the block
+	uint32_t next;         // next token for the consumer
+
+	uint8_t type[TOKEN_BLOCK_CAP];
+	uint8_t flags[TOKEN_BLOCK_CAP];  // Token flags and TOKEN_OWN
+	uint32_t offset[TOKEN_BLOCK_CAP]; // into bytes or from map + pos_base
+	uint32_t length[TOKEN_BLOCK_CAP];
+	uint32_t pos[TOKEN_BLOCK_CAP];    // charnum - pos_base
+} TokenBlock;
+
+/*
+ * Producers fill a block at a time and hand it on when it is full. The
+ * writer's block is private until then.
+*/
+typedef struct {
+	Channel *out;
+	TokenBlock *block;
+	const char *map; // input mapping, tokens pointing into it aren't copied
+} Token_writer;
+
+#define TOKEN_STREAM_BLOCKS 64 // blocks in flight between two stages
+#define TOKEN_BLOCK_FOOTPRINT (sizeof(TokenBlock) + 0x1000) // with some copied lexemes
+
+// channel of blocks, room for blocks of them
+Channel *token_stream_new(size_t blocks);
+
+// for consumers that pop blocks themselves
+void token_block_free(void *b);
+
+void token_writer_init(Token_writer *w, Channel *out, const char *map);
+
+/*
+ * packs tok, found at charnum, into the writer's block. The lexeme is copied
+ * unless it is in the mapping, so tok can go away right after. Returns false
+ * if memory ran out or the consumer halted.
+*/
+bool token_writer_put(Token_writer *w, const Token *tok, size_t charnum);
+
+/*
+ * copies token i of block b, no Token needed
+*/
+bool token_writer_copy(Token_writer *w, const TokenBlock *b, size_t i);
+
+/*
+ * hands the writer's block on, call before the producer finishes
+*/
+bool token_writer_flush(Token_writer *w);
+
+/*
+ * Stages that look ahead pop blocks themselves and hold them in a window:
+ * held[0] is the block being read, from its next token on, the rest are
+ * read ahead. A held block carries a tag of the stage's own, 0 for blocks
+ * from the input.
+*/
+typedef struct {
+	TokenBlock *b;
+	int tag;
+} Token_held;
+
+typedef struct {
+	Channel *in;
+	bool in_done;
+	size_t max; // blocks held at most, lookahead past them fails
+	Token_held *held;
+	size_t len, cap;
+} Token_window;
+
+// a place in the window, token i of held block k
+typedef struct {
+	size_t k;
+	uint32_t i;
+} Token_pos;
+
+void token_window_init(Token_window *win, Channel *in, size_t max);
+
+// frees the held blocks
+void token_window_free(Token_window *win);
+
+// held block k, read from the input if need be. NULL past the end or max
+TokenBlock *token_window_block(Token_window *win, size_t k);
+
+// holds b at k, in front of what is there. False if memory ran out
+bool token_window_insert(Token_window *win, size_t k, TokenBlock *b, int tag);
+
+// frees held block 0
+void token_window_drop(Token_window *win);
+
+/*
+ * the next token from p on that isn't whitespace or a comment, found at
+ * *b, *i, and moves p past it. TOKEN_STOP when the input or the window
+ * runs out.
+*/
+tokentype token_window_next_solid(Token_window *win, Token_pos *p, TokenBlock **b, uint32_t *i);
+
+// drops everything before p, reading goes on from there
+void token_window_seek(Token_window *win, Token_pos p);
+
+/*
+ * makes a Token for token i of block b, a flyweight for fixed lexemes. The
+ * Token lives until token_free, independent of the block.
+*/
+Token *token_block_get(const TokenBlock *b, size_t i);
+
+// the lexeme of token i of block b, not NUL terminated
+const char *token_block_lexeme(const TokenBlock *b, size_t i);
+
+/*
+ * the head block with tokens left in it, exhausted blocks are destroyed.
+ * Blocks until the producer adds one, NULL when the stream is done.
+*/
+TokenBlock *token_stream_head(Channel *tl);
+
+/*
+ * unlinks the next token of a block stream and returns it, blocking until
+ * there is one. NULL means the stream is done or memory ran out.
+*/
+Token * token_list_dequeue(Channel *tl);
+
+/*
+ * consumes whitespace tokens, returns the next token type
+*/
+tokentype token_list_consume_white_peek(Channel *tl);
+
+/*
+ * peeks the type of the next token in the stream, does not consume the token
+*/
+tokentype token_list_peek_type(Channel *tl);
+
+/*
+ * bytes held in blocks right now and the most ever held at once
+*/
+void token_block_stats(size_t *live, size_t *peak);
+#endif
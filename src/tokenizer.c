@@ -2,10 +2,14 @@
 #include <assert.h>
 #include <stdio.h>
 
-#include "threads.h"
+#include "stage.h"
 #include "errorcodes.h"
 #include "tokenizer.h"
+#include "token_block.h"
 #include "cache.h"
+#include "memscan.h"
+#include "arena.h"
+#include "keyword_hash.h"
 
 static bool until_not_white(void *data, void *args) {
 	Token *token = (Token *) data;
@@ -27,542 +31,419 @@ static bool until_not_white(void *data, void *args) {
 	}
 }
 
-tokentype token_list_consume_white_peek(List *tl) {
-	tokentype type = TOKEN_NONE;
-	list_consume_until(tl, until_not_white, (void *) &type);
-	return type;
-}
-
 void token_list_snip_white_tail(List *tl) {
 	tokentype type = TOKEN_NONE;
 	list_consume_tail_until(tl, until_not_white, &type);
 }
 
-tokentype token_list_peek_type(List *tl) {
-	Token *t = (Token *) list_peek_head_block(tl);
-	if (t) {
-		return t->type;
-	}
-	return TOKEN_ERROR;
-}
-
-static inline Token *token_alloc() {
-	return (Token *)calloc (1, sizeof (Token));
+/*
+ * tokens come from the arena, extra bytes are for a copy of the lexeme right
+ * after the token
+*/
+static inline Token *token_alloc(size_t extra) {
+	return (Token *) arena_alloc(sizeof(Token) + extra);
 }
 
-static void token_free(void *v) {
+void token_free(void *v) {
 	Token *tok = (Token *) v;
 	if (tok && !tok->fake) {
 		if (tok->isalloc) {
 			free ((void *) tok->value);
 		}
-		free(tok);
+		arena_free(tok);
 	}
 }
 
-Token * token_list_dequeue(List *tl) {
-	return (Token *) list_dequeue_block(tl);
-}
-
-static inline int is_numeric(int ch) {
-	return (ch >= '0' && ch <= '9');
-}
-
-static inline int is_lower_alpha(int ch) {
-	return (ch >= 'a' && ch <= 'z');
-}
+#define CC_DIGIT       (1 << 0)
+#define CC_ALPHA       (1 << 1)
+#define CC_IDENT       (1 << 2) // can be anywhere in an identifyer
+#define CC_IDENT_START (1 << 3) // can start an identifyer
+#define CC_WHITE       (1 << 4)
+#define CC_TAB         (1 << 5)
+
+static const unsigned char char_class[256] = {
+	['0' ... '9'] = CC_DIGIT | CC_IDENT,
+	['a' ... 'z'] = CC_ALPHA | CC_IDENT | CC_IDENT_START,
+	['A' ... 'Z'] = CC_ALPHA | CC_IDENT | CC_IDENT_START,
+	['_'] = CC_IDENT | CC_IDENT_START,
+	['$'] = CC_IDENT | CC_IDENT_START,
+	[' '] = CC_WHITE,
+	['\n'] = CC_WHITE,
+	['\r'] = CC_WHITE,
+	['\t'] = CC_WHITE | CC_TAB,
+};
 
-static inline int is_upper_alpha(int ch) {
-	return (ch >= 'A' && ch <= 'Z');
+Token * new_token_static(char *value, size_t type, size_t length, size_t charnum) {
+	Token *tok = token_alloc (0);
+	if (!tok) return tok;
+	tok->value = value;
+	tok->length = length;
+	tok->type = type;
+	tok->charnum = charnum;
+	return tok;
 }
 
-static inline int is_alpha(int ch) {
-	return (is_upper_alpha(ch) || is_lower_alpha(ch));
+/*
+ * fills tok with everything between the stream's mark and it's current
+ * position. Unmapped input is only good until the stream is peeked again, so
+ * the token has to be packed into a block before the next one is scanned.
+*/
+static Token * new_token_lexeme(cache *stream, tokentype type, size_t charnum, Token *tok) {
+	size_t len;
+	bool stable;
+	*tok = (Token) {
+		.value = cache_lexeme(stream, &len, &stable),
+		.type = type,
+		.charnum = charnum,
+	};
+	tok->length = len;
+	return tok;
 }
 
-static inline int is_alpha_numeric(int ch) {
-	return is_alpha(ch) || is_numeric(ch);
-}
+typedef struct {
+	union {
+		char s[KEYWORD_MAX_LEN]; // zero padded
+		uint64_t w[2];
+	} word;
+	size_t len;
+	tokentype type;
+	unsigned int flags;
+} Keyword;
 
+#include "keywords.h" // keyword_table
 
 /*
- * createes a buffer, reads into the buffer until a non-identifyer char is encounted.
- *
- * returns a pointer to the string, or NULL on failure
- * failure returns the cache to it's original state
+ * keywords are looked up in a perfect hash table generated from
+ * gen/keywords.txt, so there is one slot to check and no need for buf to be
+ * NUL terminated
 */
-static char * alloc_identifyer(cache *stream, int ch, size_t *len) {
-	size_t size = 16;
-	size_t i;
-	char *buf = (char *) malloc(size);
-	*len = 0;
-	if (!buf) {
-		cache_step_back(stream);
-		return NULL;
-	}
-	buf[0] = (char) ch;
-	for (i=1; ch>0; i++) {
-		ch = cache_getc(stream);
-		if (! is_alpha_numeric(ch) && ch != '_' && ch != '$') {
-			break;
-		}
-		if (i+4 > size) {
-			size*=2;
-			if ((buf = realloc(buf, size)) == NULL ) {
-				cache_step_backcount(stream, i);
-				return NULL;
-			}
-		}
-		buf[i] = (char) ch;
+static tokentype get_identifyer_type(const char *buf, size_t len, unsigned int *flags) {
+	if (len < KEYWORD_MIN_LEN || len > KEYWORD_MAX_LEN) {
+		return TOKEN_VARIABLE;
 	}
-	if (ch < EOF) {
-		cache_step_backcount(stream, i);
-		free(buf);
-		return NULL;
+	const Keyword *kw = &keyword_table[keyword_hash((const unsigned char *) buf, len, KEYWORD_MUL, KEYWORD_BITS)];
+	if (kw->len != len) {
+		return TOKEN_VARIABLE;
 	}
-	buf[i] = 0;
-	*len = i;
-	if ((buf = realloc(buf, i+3)) == NULL) {
-		cache_step_backcount(stream, i);
-		return NULL;
+	uint64_t w[2] = {0, 0};
+	memcpy(w, buf, len);
+	if (w[0] != kw->word.w[0] || w[1] != kw->word.w[1]) {
+		return TOKEN_VARIABLE;
 	}
-	cache_step_back(stream);
-	return buf;
+	*flags = kw->flags;
+	return kw->type;
 }
 
-static char * alloc_numeric(cache *stream, int ch, size_t *len) {
-	// TODO HANDLE 0xXX 0bBB 0oOO formats
-	size_t size = 16;
-	size_t i;
-	char *buf = (char *) malloc(size);
-	*len = 0;
-	if (!buf) {
-		cache_step_back(stream);
-		return NULL;
-	}
-	buf[0] = (char) ch;
-	for (i=1; ch>0; i++) {
-		ch = cache_getc(stream);
-		if (! is_numeric(ch)) {
-			break;
+/*
+ * The scan_* functions are called with the opening characters already
+ * consumed, they consume the rest of the token. They return false if memory
+ * ran out or the token can't be finished.
+ *
+ * Bodies are searched with memscan, which jumps to the next byte that could
+ * matter instead of looking at every byte.
+*/
+static bool scan_string(cache *stream, int start) {
+	const char stops[] = {start, '\\'};
+	size_t avail, i;
+	for (;;) {
+		// 2 so an escape and the char it escapes are always seen together
+		const unsigned char *p = cache_peek(stream, 2, &avail);
+		if (!p) {
+			return false;
 		}
-		if (i+4 > size) {
-			size*=2;
-			if ((buf = realloc(buf, size)) == NULL) {
-				cache_step_backcount(stream, i);
-				return NULL;
+		for (i = 0; ; i += 2) {
+			i += memscan(p + i, avail - i, stops, 2);
+			if (i >= avail) {
+				break;
+			}
+			if (p[i] == start) {
+				cache_consume(stream, i + 1);
+				return true; // found it
+			}
+			if (i + 1 == avail) {
+				break; // escape is split, get more
 			}
 		}
-		buf[i] = (char) ch;
-	}
-	if (ch < EOF) {
-		cache_step_backcount(stream, i);
-		free(buf);
-		return NULL;
-	}
-	buf[i] = 0;
-	*len = i;
-	if ((buf = realloc(buf, i+3)) == NULL) {
-		cache_step_backcount(stream, i);
-		return NULL;
+		if (i == 0) {
+			return false; // input ended inside the string
+		}
+		cache_consume(stream, i);
 	}
-	cache_step_back(stream);
-	return buf;
 }
 
-
-Token * new_token_static(char *value, size_t type, size_t length, size_t charnum) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->value = value;
-	tok->length = length;
-	tok->type = type;
-	tok->charnum = charnum;
-	return tok;
-}
-
-static Token * new_token_error(int ch, size_t charnum) {
-	char buf[2];
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	buf[0] = (char) ch;
-	buf[1] = '\x00';
-
-	tok->isalloc = true;
-	if ((tok->value = strdup(buf)) == NULL) {
-		free(tok);
-		return NULL;
+static bool scan_line_comment(cache *stream) {
+	size_t avail;
+	for (;;) {
+		const unsigned char *p = cache_peek(stream, 1, &avail);
+		if (!p) {
+			return false;
+		}
+		if (avail == 0) {
+			return true; // did not get everything, but save what we did get
+		}
+		size_t i = memscan(p, avail, "\n", 1);
+		if (i < avail) {
+			cache_consume(stream, i + 1);
+			return true;
+		}
+		cache_consume(stream, avail);
 	}
-	tok->length = 1;
-	tok->type = TOKEN_ERROR;
-	tok->charnum = charnum;
-	return tok;
 }
 
-static size_t get_identifyer_type(char *buf) {
-	size_t ret = TOKEN_VARIABLE;
-	switch (buf[0]) {
-		case 'c':
-			if (strcmp("catch", buf) == 0)
-				ret = TOKEN_CATCH;
-			else if (strcmp("const", buf) == 0)
-				ret = TOKEN_CONST;
-			break;
-		case 'd':
-			if (strcmp("do", buf) == 0)
-				ret = TOKEN_FOR;
-			break;
-		case 'e':
-			if (strcmp("else", buf) == 0)
-				ret = TOKEN_ELSE;
-			break;
-		case 'f':
-			if (strcmp("for", buf) == 0)
-				ret = TOKEN_FOR;
-			else if (strcmp("function", buf) == 0)
-				ret = TOKEN_FUNCTION;
-			break;
-		case 'i':
-			if (strcmp("if", buf) == 0)
-				ret = TOKEN_IF;
-			break;
-		case 'l':
-			if (strcmp("let", buf) == 0)
-				ret = TOKEN_LET;
-			break;
-		case 'r':
-			if (strcmp("return", buf) == 0)
-				ret = TOKEN_RETURN;
-			break;
-		case 't':
-			if (strcmp("throw", buf) == 0)
-				ret = TOKEN_THROW;
-			else if (strcmp("typeof", buf) == 0)
-				ret = TOKEN_TYPEOF;
-			break;
-		case 'v':
-			if (strcmp("var", buf) == 0)
-				ret = TOKEN_VAR;
-			break;
-		case 'w':
-			if (strcmp("while", buf) == 0)
-				ret = TOKEN_WHILE;
-			break;
+static bool scan_multi_line_comment(cache *stream) {
+	size_t avail, i;
+	for (;;) {
+		const unsigned char *p = cache_peek(stream, 2, &avail);
+		if (!p) {
+			return false;
+		}
+		if (avail < 2) {
+			// did not finish, but save what we have
+			cache_consume(stream, avail);
+			return true;
+		}
+		// last byte is left out, it could be the start of */
+		for (i = 0; ; i++) {
+			i += memscan(p + i, avail - 1 - i, "*", 1);
+			if (i >= avail - 1) {
+				break;
+			}
+			if (p[i + 1] == '/') {
+				cache_consume(stream, i + 2);
+				return true;
+			}
+		}
+		cache_consume(stream, i);
 	}
-	return ret;
 }
 
-static Token * new_token_identifyer(size_t charnum, char *value, size_t len) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->isalloc = true;
-	tok->length = len;
-	tok->value = value;
-	tok->type = get_identifyer_type(value);
-	tok->charnum = charnum;
-	return tok;
-}
-
-static Token * new_token_number(size_t charnum, char *value, size_t len) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->isalloc = true;
-	tok->length = len;
-	tok->value = value;
-	tok->charnum = charnum;
-	tok->type = TOKEN_NUMERIC;
-	return tok;
-}
-
-static char * alloc_string(cache *stream, int start, size_t *len) {
-	size_t size = 128;
-	int ch;
-	size_t i;
-	char *buf = (char *) malloc(size);
-	int skip = 0;
-	if (!buf) {
-		cache_step_back(stream);
-		return NULL;
-	}
-	*len = 0;
-	buf[0] = (char) start;
-	for (i=1; ; i++) {
-		ch = cache_getc(stream);
-		if (i+4 > size) {
-			size*=2;
-			if ((buf = realloc(buf, size)) == NULL) {
-				cache_step_backcount(stream, i);
-				return NULL;
+static bool scan_regex(cache *stream) {
+	bool in_square = false;
+	size_t avail, i;
+	for (;;) {
+		const unsigned char *p = cache_peek(stream, 2, &avail);
+		if (!p) {
+			return false;
+		}
+		if (avail == 0) {
+			return true; // did not finish, but save what we have
+		}
+		for (i = 0; ; i++) {
+			i += memscan(p + i, avail - i, "\\[]/", 4);
+			if (i >= avail) {
+				break;
+			}
+			if (p[i] == '\\') {
+				if (i + 1 == avail) {
+					break; // escape is split, get more
+				}
+				i++;
+			} else if (in_square) {
+				// trying to escape the square...
+				if (p[i] == ']') {
+					in_square = false;
+				}
+			} else if (p[i] == '[') {
+				in_square = true;
+			} else if (p[i] == '/') {
+				// found ending /, what follows are flags
+				cache_consume(stream, i + 1);
+				cache_skip(stream, char_class, CC_ALPHA);
+				return true;
 			}
 		}
-		buf[i] = (char) ch;
-
-		if (skip) {
-			skip = 0;
-		} else if (ch == '\\') {
-			skip = 1;
-		} else if (ch == start) {
-			break; // found it
-		} else if (ch < 0) {
-			cache_step_backcount(stream, i);
-			free(buf);
-			return NULL;
+		if (i == 0) {
+			// input ended on an escape
+			cache_consume(stream, avail);
+			return true;
 		}
+		cache_consume(stream, i);
 	}
-	buf[i+1] = 0;
-	*len = i+1;
+}
 
-	if ((buf = realloc(buf, i+3)) == NULL) {
-		cache_step_backcount(stream, i);
+static Token * new_token_scanned(cache *stream, bool (*scan)(cache *), tokentype type, size_t charnum, Token *tok) {
+	if (!scan(stream)) {
+		cache_rewind(stream);
 		return NULL;
 	}
-
-	return buf;
+	return new_token_lexeme(stream, type, charnum, tok);
 }
 
-static Token * new_token_string(cache *stream, int start, size_t charnum) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->value = alloc_string(stream, start, &tok->length);
-	if (!tok->value) {
-		free(tok);
+static Token * new_token_string(cache *stream, int start, size_t charnum, Token *tok) {
+	if (!scan_string(stream, start)) {
+		cache_rewind(stream);
 		return NULL;
 	}
-	tok->isalloc = true;
-	tok->charnum = charnum;
 	switch (start) {
 		case '"':
-			tok->type = TOKEN_DOUBLE_QUOTE_STRING;
-			break;
+			return new_token_lexeme(stream, TOKEN_DOUBLE_QUOTE_STRING, charnum, tok);
 		case '`':
-			tok->type = TOKEN_TILDA_STRING;
-			break;
+			return new_token_lexeme(stream, TOKEN_TILDA_STRING, charnum, tok);
 		default:
-			tok->type = TOKEN_SINGLE_QUOTE_STRING;
-			break;
+			return new_token_lexeme(stream, TOKEN_SINGLE_QUOTE_STRING, charnum, tok);
 	}
-	return tok;
 }
 
-
-static char * alloc_line_comment(cache *stream, size_t *len) {
-	size_t i;
-	int ch = '/';
-	size_t size = 90;
-	char *buf = (char *) malloc(size);
-	if (!buf) return NULL;
-	buf[0] = ch;
-	buf[1] = ch;
-	for (i=2; ch!='\n' && ch > 0; i++) {
-		ch = cache_getc(stream);
-		if (i+3 > size) {
-			size += 16;
-			if ((buf = (char *) realloc(buf, size)) == NULL) {
-				return NULL;
-			}
-		}
-		buf[i] = ch;
-	}
-	if (ch < 0) {
-		// did not get everything, but save what we did get and step cache back
-		// to prev position before error
-		cache_step_back(stream);
-		i--;
-	}
-	if ((buf = (char *) realloc(buf, i+3)) == NULL) {
-		return NULL;
-	}
-	*len = i;
-	buf[i] = '\x00';
-	return buf;
-}
-
-static Token * new_token_line_comment(cache *stream, size_t charnum) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->value = alloc_line_comment(stream, &tok->length);
-	if (!tok->value) {
-		free(tok);
-		return NULL;
-	}
-	tok->isalloc = true;
-	tok->charnum = charnum;
-	tok->type = TOKEN_LINE_COMMENT;
-	return tok;
-}
-
-static char * alloc_multi_line_comment(cache *stream, size_t *len) {
-	size_t i;
-	int prev = '/';
-	int ch = '*';
-	size_t size = 90;
-	char *buf = (char *) malloc(size);
-	if (!buf) return NULL;
-	buf[0] = (char) prev;
-	buf[1] = (char) ch;
-	for (i=2; ; i++) {
-		ch = cache_getc(stream);
-		if (ch < 0) break;
-		if (i+3 > size) {
-			size += 16;
-			if ((buf = (char *) realloc(buf, size)) == NULL ) {
-				return NULL;
-			}
-		}
-		buf[i] = ch;
-		if (prev == '*' && ch == '/') break;
-		prev = ch;
-	}
-	if (ch < 0) {
-		// did not finish, but save what we have and restore cache
-		cache_step_back(stream);
-		i--;
-	}
-	if ((buf = (char *) realloc(buf, i+3)) == NULL) {
-		return NULL;
+// after these a '/' divides, anywhere else it starts a regex
+static inline bool regex_allowed(size_t prev_type) {
+	switch (prev_type) {
+	case TOKEN_VARIABLE:
+	case TOKEN_NUMERIC:
+	case TOKEN_CLOSE_PAREN:
+	case TOKEN_CLOSE_BRACE:
+		return false;
+	default:
+		return true;
 	}
-	*len = i+1;
-	buf[i+1] = '\x00';
-	return buf;
-
 }
 
-static char * alloc_regex(cache *stream, size_t *len) {
-	size_t i;
-	int skip = 0;
-	int in_square = 0;
-	int end_slash = 0;
-	size_t size = 64;
-	char *buf = (char *) malloc(size);
-	int ch = '/';
-	if (!buf) return NULL;
-	buf[0] = ch;
-	for (i=1; ch > 0; i++) {
-		ch = cache_getc(stream);
-		if (i+3 > size) {
-			size += 16;
-			if ((buf = (char *) realloc(buf, size)) == NULL) {
-				return NULL;
-			}
-		}
-		buf[i] = ch;
-		if (end_slash) {
-			// flags
-			if (! is_alpha(ch)) {
-				cache_step_back(stream);
-				break;
-			}
-		} else if (in_square) {
-			// trying to escape the square...
-			if (skip) {
-				skip = 0;
-			}else if (ch == '\\') {
-				skip=1;
-			}else if (ch == ']') {
-				in_square = 0;
-			}
-		}else {
-			// looking for ending /
-			if (skip) {
-				skip = 0;
-			}else if (ch == '[') {
-				in_square = 1;
-			}else if (ch == '\\') {
-				skip = 1;
-			}else if (ch == '/') {
-				end_slash = 1;
-			}else {
-				skip = 0;
-			}
-
-		}
-	}
-	if (ch < 0) {
-		// did not finish, but save what we have and restore cache
-		cache_step_back(stream);
-		i--;
-	}
-	if ((buf = (char *) realloc(buf, i+3)) == NULL) {
-		return NULL;
-	}
-	*len = i;
-	buf[i] = '\x00';
-	return buf;
-
+/*
+ * Tokens with a fixed lexeme are shared, read only, flyweights. They don't
+ * know where they were found, the token blocks keep that. Every type has at
+ * most one fixed lexeme, so the type is all a block needs to bring one back.
+*/
+#define FLYWEIGHT(v, t) [t] = {.value = v, .length = sizeof(v) - 1, .type = t, .fake = true}
+
+const Token token_fixed[TOKEN_VARIABLE + 1] = {
+	FLYWEIGHT("\xff", TOKEN_EOF),
+	FLYWEIGHT("\t", TOKEN_TAB),
+	FLYWEIGHT(" ", TOKEN_SPACE),
+	[TOKEN_NEWLINE] = {.value = "\n", .length = 1, .type = TOKEN_NEWLINE, .newlines = 1, .fake = true},
+	FLYWEIGHT("\r", TOKEN_CARRAGE_RETURN),
+	FLYWEIGHT("(", TOKEN_OPEN_PAREN),
+	FLYWEIGHT(")", TOKEN_CLOSE_PAREN),
+	FLYWEIGHT("{", TOKEN_OPEN_CURLY),
+	FLYWEIGHT("}", TOKEN_CLOSE_CURLY),
+	FLYWEIGHT("[", TOKEN_OPEN_BRACE),
+	FLYWEIGHT("]", TOKEN_CLOSE_BRACE),
+	FLYWEIGHT(",", TOKEN_COMMA),
+	FLYWEIGHT(".", TOKEN_DOT),
+	FLYWEIGHT(":", TOKEN_COLON),
+	FLYWEIGHT(";", TOKEN_SEMICOLON),
+	FLYWEIGHT("?", TOKEN_QUESTIONMARK),
+	FLYWEIGHT("+", TOKEN_ADD),
+	FLYWEIGHT("-", TOKEN_SUBTRACT),
+	FLYWEIGHT("*", TOKEN_MULTIPLY),
+	FLYWEIGHT("/", TOKEN_DIVIDE),
+	FLYWEIGHT("**", TOKEN_EXPONENT),
+	FLYWEIGHT("||", TOKEN_LOGICAL_OR),
+	FLYWEIGHT("&&", TOKEN_LOGICAL_AND),
+	FLYWEIGHT("??", TOKEN_NULL_COALESCING),
+	FLYWEIGHT("&", TOKEN_BITWISE_AND),
+	FLYWEIGHT("^", TOKEN_BITWISE_XOR),
+	FLYWEIGHT("|", TOKEN_BITWISE_OR),
+	FLYWEIGHT("<<", TOKEN_BITSHIFT_LEFT),
+	FLYWEIGHT(">>>", TOKEN_ZERO_FILL_RIGHT_SHIFT),
+	FLYWEIGHT(">>", TOKEN_SIGNED_BITSHIFT_RIGHT),
+	FLYWEIGHT("%", TOKEN_MOD),
+	FLYWEIGHT("^=", TOKEN_BITWISE_XOR_ASSIGN),
+	FLYWEIGHT("*=", TOKEN_MULTIPLY_ASSIGN),
+	FLYWEIGHT("/=", TOKEN_DIVIDE_ASSIGN),
+	FLYWEIGHT("|=", TOKEN_BITWISE_OR_ASSIGN),
+	FLYWEIGHT("&=", TOKEN_BITWISE_AND_ASSIGN),
+	FLYWEIGHT("<<=", TOKEN_BITSHIFT_LEFT_ASSIGN),
+	FLYWEIGHT(">>=", TOKEN_BITSHIFT_RIGHT_ASSIGN),
+	FLYWEIGHT("-=", TOKEN_MINUS_ASSIGN),
+	FLYWEIGHT("%=", TOKEN_MOD_ASSIGN),
+	FLYWEIGHT("=", TOKEN_ASSIGN),
+	FLYWEIGHT("=>", TOKEN_ARROW_FUNC),
+	FLYWEIGHT("==", TOKEN_EQUAL_EQUAL),
+	FLYWEIGHT("!=", TOKEN_NOT_EQUAL),
+	FLYWEIGHT("+=", TOKEN_PLUS_EQUAL),
+	FLYWEIGHT("--", TOKEN_DECREMENT),
+	FLYWEIGHT("<=", TOKEN_LESSTHAN_OR_EQUAL),
+	FLYWEIGHT("<", TOKEN_LESSTHAN),
+	FLYWEIGHT(">", TOKEN_GREATER_THAN),
+	FLYWEIGHT(">=", TOKEN_GREATERTHAN_OR_EQUAL),
+	FLYWEIGHT("===", TOKEN_EQUAL_EQUAL_EQUAL),
+	FLYWEIGHT("!==", TOKEN_NOT_EQUAL_EQUAL),
+	FLYWEIGHT("!", TOKEN_NOT),
+	FLYWEIGHT("~", TOKEN_BITWISE_NOT),
+	FLYWEIGHT("++", TOKEN_INCREMENT),
+};
+#undef FLYWEIGHT
+
+static inline Token * simple_token(cache *stream, tokentype type) {
+	const Token *fly = &token_fixed[type];
+	cache_consume(stream, fly->length);
+	return (Token *) fly;
 }
 
-static Token * new_regex(cache *stream, size_t charnum) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->value = alloc_regex(stream, &tok->length);
-	if (!tok->value) {
-		free(tok);
-		return NULL;
+// the lexeme is spelled out for whoever reads the lexer, token_fixed has it
+#define SIMPLE_TOKEN(value, name) simple_token(stream, name)
+/*
+ * A run of whitespace becomes one token, typed by its first char, that knows
+ * how many newlines it has. Runs end right after their last newline, so a
+ * line never has whitespace from the next one, and a run of tabs ends at
+ * the first char that isn't one.
+*/
+static Token * scan_white(cache *stream, size_t charnum, Token *tok) {
+	size_t avail, len, i;
+	const unsigned char *p = cache_peek(stream, 1, &avail);
+	unsigned char first = p[0];
+	tokentype type = first == ' ' ? TOKEN_SPACE
+		: first == '\t' ? TOKEN_TAB
+		: first == '\n' ? TOKEN_NEWLINE
+		: TOKEN_CARRAGE_RETURN;
+
+	cache_skip(stream, char_class, first == '\t' ? CC_TAB : CC_WHITE);
+	bool stable;
+	p = (const unsigned char *) cache_lexeme(stream, &len, &stable);
+	for (i = len; i > 0 && p[i - 1] != '\n'; i--);
+	if (i > 0 && i < len) {
+		// leave the whitespace after the last newline for the next run
+		len = i;
+		cache_rewind(stream);
+		cache_consume(stream, len);
+	}
+	if (len == 1) {
+		return (Token *) &token_fixed[type];
+	}
+
+	new_token_lexeme(stream, type, charnum, tok);
+	for (i = 0; i < len; i++) {
+		tok->newlines += p[i] == '\n';
 	}
-	tok->isalloc = true;
-	tok->charnum = charnum;
-	tok->type = TOKEN_REGEX;
 	return tok;
 }
 
-
-static Token * new_token_multi_line_comment(cache *stream, size_t charnum) {
-	Token *tok = token_alloc ();
-	if (!tok) return tok;
-	tok->value = alloc_multi_line_comment(stream, &tok->length);
-	if (!tok->value) {
-		free(tok);
+/*
+ * returns the next token, either a flyweight or scratch filled in. Nothing
+ * is allocated, whatever is kept has to be copied before the next call.
+*/
+#define PEEK(i) ((i) < avail ? p[i] : EOF)
+static Token * scan_token(cache *stream, size_t prev_type, Token *scratch) {
+	size_t avail;
+	cache_mark(stream);
+	size_t charnum = cache_getcharnum(stream);
+	// longest operator is 3 chars, 4 is plenty
+	const unsigned char *p = cache_peek(stream, 4, &avail);
+	if (!p) {
 		return NULL;
 	}
-	tok->isalloc = true;
-	tok->charnum = charnum;
-	tok->type = TOKEN_MULTI_LINE_COMMENT;
-	return tok;
-}
+	if (avail == 0) {
+		return (Token *) &token_fixed[TOKEN_EOF];
+	}
 
-#define SIMPLE_TOKEN(value, name) new_token_static(value, name, sizeof(value)-1, charnum);
-static Token * scan_token(cache *stream, size_t prev_type) {
-	size_t charnum = cache_getcharnum(stream);
-	int ch = cache_getc(stream);
+	int ch = p[0];
 	Token *tok = NULL;
-	if (is_alpha(ch) || ch == '_' || ch == '$') {
-		size_t len;
-		char *buf = alloc_identifyer(stream, ch, &len);
-		if (!buf) {
-			return NULL;
-		}
-		tok = new_token_identifyer(charnum, buf, len);
-		if (!tok) {
-			free(buf);
-			return NULL;
-		}
-		return tok;
-	} else if (is_numeric(ch)) {
-		size_t len;
-		char *buf = alloc_numeric(stream, ch, &len);
-		if (!buf) {
-			return NULL;
-		}
-		tok = new_token_number(charnum, buf, len);
-		if (!tok) {
-			free(buf);
-			return NULL;
-		}
+	if (char_class[ch] & CC_IDENT_START) {
+		cache_skip(stream, char_class, CC_IDENT);
+		tok = new_token_lexeme(stream, TOKEN_VARIABLE, charnum, scratch);
+		tok->type = get_identifyer_type(tok->value, tok->length, &tok->flags);
 		return tok;
+	} else if (char_class[ch] & CC_DIGIT) {
+		// letters and _ belong to the literal too: 0x1f, 0b101, 1e5, 10n, 1_000
+		cache_skip(stream, char_class, CC_IDENT);
+		return new_token_lexeme(stream, TOKEN_NUMERIC, charnum, scratch);
 	}
 	switch (ch) {
 		// simple single characters
 		case '\r':
-			tok = SIMPLE_TOKEN("\r", TOKEN_CARRAGE_RETURN);
-			break;
 		case ' ':
-			tok = SIMPLE_TOKEN(" ", TOKEN_SPACE);
-			break;
 		case '\t':
-			tok = SIMPLE_TOKEN("\t", TOKEN_TAB);
-			break;
 		case '\n':
-			tok = SIMPLE_TOKEN("\n", TOKEN_NEWLINE);
+			tok = scan_white(stream, charnum, scratch);
 			break;
 		case '{':
 			tok = SIMPLE_TOKEN("{", TOKEN_OPEN_CURLY);
@@ -595,17 +476,13 @@ static Token * scan_token(cache *stream, size_t prev_type) {
 			tok = SIMPLE_TOKEN(";", TOKEN_SEMICOLON);
 			break;
 		case '!':
-			ch = cache_getc(stream);
-			if (ch == '=') {
-				ch = cache_getc(stream);
-				if (ch == '=') {
+			if (PEEK(1) == '=') {
+				if (PEEK(2) == '=') {
 					tok = SIMPLE_TOKEN("!==", TOKEN_NOT_EQUAL_EQUAL);
 				} else {
-					cache_step_back(stream);
 					tok = SIMPLE_TOKEN("!=", TOKEN_NOT_EQUAL);
 				}
 			} else {
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("!", TOKEN_NOT);
 			}
 			break;
@@ -616,155 +493,125 @@ static Token * scan_token(cache *stream, size_t prev_type) {
 		// 1 or more chars
 		case '?':
 			// TODO optional chaining
-			ch = cache_getc(stream);
-			if (ch == '?') {
+			if (PEEK(1) == '?') {
 				tok = SIMPLE_TOKEN("??", TOKEN_NULL_COALESCING);
 			}else {
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("?", TOKEN_QUESTIONMARK);
 			}
 			break;
 		case '/':
-			ch = cache_getc(stream); // /X
-			if (ch == '/') {
-				tok = new_token_line_comment(stream, charnum);
-			}else if (ch == '*') {
-				tok = new_token_multi_line_comment(stream, charnum);
-			}else if (prev_type != TOKEN_VARIABLE
-				&& prev_type != TOKEN_NUMERIC && prev_type != TOKEN_CLOSE_PAREN
-				&& prev_type != TOKEN_CLOSE_BRACE
-			) {
-				cache_step_back(stream);
-				tok = new_regex(stream, charnum);
-			}else if (ch == '=') {
+			if (PEEK(1) == '/') {
+				cache_consume(stream, 2);
+				tok = new_token_scanned(stream, scan_line_comment, TOKEN_LINE_COMMENT, charnum, scratch);
+			}else if (PEEK(1) == '*') {
+				cache_consume(stream, 2);
+				tok = new_token_scanned(stream, scan_multi_line_comment, TOKEN_MULTI_LINE_COMMENT, charnum, scratch);
+			}else if (regex_allowed(prev_type)) {
+				cache_consume(stream, 1);
+				tok = new_token_scanned(stream, scan_regex, TOKEN_REGEX, charnum, scratch);
+			}else if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("/=", TOKEN_DIVIDE_ASSIGN);
 			}else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("/", TOKEN_DIVIDE);
 			}
 			break;
 		case '=':
-			ch = cache_getc(stream);
-			if (ch == '=') {
-				ch = cache_getc(stream);
-				if (ch == '=') {
+			if (PEEK(1) == '=') {
+				if (PEEK(2) == '=') {
 					tok = SIMPLE_TOKEN("===", TOKEN_EQUAL_EQUAL_EQUAL);
 				} else {
-					cache_step_back(stream);
 					tok = SIMPLE_TOKEN("==", TOKEN_EQUAL_EQUAL);
 				}
-			} else if (ch == '>') {
+			} else if (PEEK(1) == '>') {
 				tok = SIMPLE_TOKEN("=>", TOKEN_ARROW_FUNC);
 			} else {
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("=", TOKEN_ASSIGN);
 			}
 			break;
 		case '-':
-			ch = cache_getc(stream);
-			if (ch == '-') {
+			if (PEEK(1) == '-') {
 				tok = SIMPLE_TOKEN("--", TOKEN_DECREMENT);
-			} else if (ch == '=') {
+			} else if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("-=", TOKEN_MINUS_ASSIGN);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("-", TOKEN_SUBTRACT);
 			}
 			break;
 		case '%':
-			ch = cache_getc(stream);
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("%=", TOKEN_MOD_ASSIGN);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("%", TOKEN_MOD);
 			}
 			break;
 		case '*':
-			ch = cache_getc(stream);
-			if (ch == '*') {
+			if (PEEK(1) == '*') {
 				tok = SIMPLE_TOKEN("**", TOKEN_EXPONENT);
-			} else if (ch == '=') {
+			} else if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("*=", TOKEN_MULTIPLY_ASSIGN);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("*", TOKEN_MULTIPLY);
 			}
 			break;
 		case '+':
-			ch = cache_getc(stream);
-			if (ch == '+') {
+			if (PEEK(1) == '+') {
 				tok = SIMPLE_TOKEN("++", TOKEN_INCREMENT);
-			} else if (ch == '=') {
+			} else if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("+=", TOKEN_PLUS_EQUAL);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("+", TOKEN_ADD);
 			}
 			break;
 		case '^':
-			ch = cache_getc(stream);
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("^=", TOKEN_BITWISE_XOR_ASSIGN);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("^", TOKEN_BITWISE_XOR);
 			}
 			break;
 		case '|':
-			ch = cache_getc(stream);
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("|=", TOKEN_BITWISE_OR_ASSIGN);
-			} else if (ch == '|') {
+			} else if (PEEK(1) == '|') {
 				tok = SIMPLE_TOKEN("||", TOKEN_LOGICAL_OR);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("|", TOKEN_BITWISE_OR);
 			}
 			break;
 		case '&':
-			ch = cache_getc(stream);
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("&=", TOKEN_BITWISE_AND_ASSIGN);
-			} else if (ch == '&') {
+			} else if (PEEK(1) == '&') {
 				tok = SIMPLE_TOKEN("&&", TOKEN_LOGICAL_AND);
 			} else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("&", TOKEN_BITWISE_AND);
 			}
 			break;
 		case '<':
-			ch = cache_getc(stream); // <X
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN("<=", TOKEN_LESSTHAN_OR_EQUAL);
-			} else if (ch == '<') {
-				ch = cache_getc(stream); // <<X
-				if (ch == '=') {
+			} else if (PEEK(1) == '<') {
+				if (PEEK(2) == '=') {
 					tok = SIMPLE_TOKEN("<<=", TOKEN_BITSHIFT_LEFT_ASSIGN);
+				} else {
+					tok = SIMPLE_TOKEN("<<", TOKEN_BITSHIFT_LEFT);
 				}
-				cache_step_back(stream);
-				tok = SIMPLE_TOKEN("<<", TOKEN_BITSHIFT_LEFT);
 			}else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN("<", TOKEN_LESSTHAN);
 			}
 			break;
 		case '>':
-			ch = cache_getc(stream); // >X
-			if (ch == '=') {
+			if (PEEK(1) == '=') {
 				tok = SIMPLE_TOKEN(">=", TOKEN_GREATERTHAN_OR_EQUAL);
-			} else if (ch == '>') {
-				ch = cache_getc(stream); // >>X
-				if (ch == '=') {
+			} else if (PEEK(1) == '>') {
+				if (PEEK(2) == '=') {
 					tok = SIMPLE_TOKEN(">>=", TOKEN_BITSHIFT_RIGHT_ASSIGN);
-				} else if (ch == '>') {
+				} else if (PEEK(2) == '>') {
 					tok = SIMPLE_TOKEN(">>>", TOKEN_ZERO_FILL_RIGHT_SHIFT);
 				} else {
-					cache_step_back(stream);
 					tok = SIMPLE_TOKEN(">>", TOKEN_SIGNED_BITSHIFT_RIGHT);
 				}
 			}else{
-				cache_step_back(stream);
 				tok = SIMPLE_TOKEN(">", TOKEN_GREATER_THAN);
 			}
 			break;
@@ -772,103 +619,372 @@ static Token * scan_token(cache *stream, size_t prev_type) {
 		case '\'':
 		case '`':
 		case '"':
-			tok = new_token_string(stream, ch, charnum);
+			cache_consume(stream, 1);
+			tok = new_token_string(stream, ch, charnum, scratch);
 			break;
 
-		case EOF:
-			tok = SIMPLE_TOKEN("\xff", TOKEN_EOF);
-			break;
 		default:
-			tok = new_token_error(ch, charnum);
+			cache_consume(stream, 1);
+			tok = new_token_lexeme(stream, TOKEN_ERROR, charnum, scratch);
+#undef PEEK
 #undef SIMPLE_TOKEN
 	}
 	return tok;
 }
 
-static void * gettokens(void *in) {
-	Thread_params *t = (Thread_params *) in;
-	int fd = *(int *) t->input;
-	free(t->input);
-	List *tl = (List *) t->output;
-	free(t);
-
-	size_t prev_type = TOKEN_NONE;
-	Token *token = NULL;
-
-	if (fd < 0) {
-		list_status_set_flag(tl, LIST_HALT_CONSUMER | LIST_PRODUCER_FIN);
-		return NULL;
+static inline bool is_white_type(tokentype type) {
+	switch (type) {
+	case TOKEN_TAB:
+	case TOKEN_SPACE:
+	case TOKEN_NEWLINE:
+	case TOKEN_CARRAGE_RETURN:
+		return true;
+	default:
+		return false;
 	}
+}
 
-	cache * stream = cache_init(128, fd);
-	if (!stream) {
-		list_status_set_flag(tl,
-		  LIST_MEMFAIL | LIST_PRODUCER_FIN | LIST_HALT_CONSUMER);
-		return NULL;
+// whitespace does not change how the next '/' is read
+static inline size_t track_prev_type(size_t prev_type, tokentype type) {
+	if (is_white_type(type)) {
+		return prev_type;
 	}
+	return type;
+}
+
+static bool lex_serial(cache *stream, Token_writer *w, bool with_eof) {
+	size_t prev_type = TOKEN_NONE;
+	Token scratch;
+	Token *token = NULL;
 
 	bool status = true;
 	bool eof = false;
 	while (status && !eof) {
-		token = scan_token(stream, prev_type);
+		size_t charnum = cache_getcharnum(stream);
+		token = scan_token(stream, prev_type, &scratch);
 		if (token != NULL) {
-			switch (token->type) {
-			case TOKEN_EOF:
-				eof = true;
-				break;
-			case TOKEN_TAB:
-			case TOKEN_SPACE:
-			case TOKEN_NEWLINE:
-			case TOKEN_CARRAGE_RETURN:
-				break;
-			default:
-				prev_type = token->type;
+			eof = token->type == TOKEN_EOF;
+			if (eof && !with_eof) {
 				break;
 			}
-			status = list_append_block(tl, token);
+			prev_type = track_prev_type(prev_type, token->type);
+			status = token_writer_put(w, token, charnum);
 		} else {
 			fprintf(stderr, "Error parsing token at char position %ld\n", cache_getcharnum(stream));
-			status = LIST_PRODUCER_CONTINUE(list_status_set_flag(tl, LIST_MEMFAIL));
+			status = LIST_PRODUCER_CONTINUE(channel_status_set_flag(w->out, LIST_MEMFAIL));
 		}
 	}
+	return status;
+}
 
-	cache_destroy(stream);
-	list_producer_fin(tl);
+static bool gettokens_serial(cache *stream, Token_writer *w) {
+	return lex_serial(stream, w, true);
+}
+
+/*
+ * Large mapped files are cut into chunks that are lexed at the same time.
+ * Nobody knows what state the lexer is in where a chunk starts, it could be
+ * inside a string, a comment or a regex, so each chunk guesses it is in code
+ * right after a ';'. The chunks are then stitched together in order: a
+ * chunk's tokens are used from the first one that starts exactly where the
+ * previous chunk left off, with the same regex-or-divide state. Anything the
+ * guess got wrong is lexed again from the true position.
+*/
+#define CHUNK_SIZE   0x80000
+#define CHUNK_WINDOW 2 // chunks in flight per worker, bounds memory
+#define CHUNK_BLOCK_RATIO 5 // block bytes per input byte, roughly
+#define CHUNK_GUESS  TOKEN_SEMICOLON
+
+typedef struct {
+	Channel *tokens; // blocks of speculative tokens, starting before limit
+	size_t start, limit;
+	bool done;
+} Chunk;
+
+typedef struct {
+	cache *stream;
+	Chunk *chunks;
+	size_t nchunks;
+	size_t next;     // next chunk for a worker to pick up
+	size_t stitched; // chunks already handed downstream
+	size_t window;
+	bool halt;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} Chunker;
+
+// start chunks after an obvious statement end, to make the guess likely right
+static size_t chunk_start(cache *stream, size_t nominal) {
+	cache view;
+	size_t avail, i;
+	cache_view(stream, &view, nominal);
+	const unsigned char *p = cache_peek(&view, 0, &avail);
+	if (avail > 256) {
+		avail = 256;
+	}
+	for (i = 0; i < avail; i++) {
+		if (p[i] == ';' || p[i] == '}' || p[i] == '\n') {
+			return nominal + i + 1;
+		}
+	}
+	return nominal;
+}
+
+static void lex_chunk(cache *stream, Chunk *ck) {
+	cache view;
+	cache_view(stream, &view, ck->start);
+	Token_writer w;
+	token_writer_init(&w, ck->tokens, (const char *) view.map);
+	size_t prev_type = CHUNK_GUESS;
+	size_t charnum;
+	Token scratch;
+	while ((charnum = cache_getcharnum(&view)) < ck->limit) {
+		Token *tok = scan_token(&view, prev_type, &scratch);
+		if (!tok) {
+			break; // whoever stitches this will find out
+		}
+		prev_type = track_prev_type(prev_type, tok->type);
+		if (!token_writer_put(&w, tok, charnum)) {
+			break;
+		}
+	}
+	token_writer_flush(&w);
+	channel_producer_fin(ck->tokens);
+}
+
+static void *chunk_worker(void *in) {
+	Chunker *ch = (Chunker *) in;
+	stage_pin_self();
+	pthread_mutex_lock(&ch->lock);
+	for (;;) {
+		while (!ch->halt && ch->next < ch->nchunks
+			&& ch->next >= ch->stitched + ch->window) {
+			pthread_cond_wait(&ch->cond, &ch->lock);
+		}
+		if (ch->halt || ch->next >= ch->nchunks) {
+			break;
+		}
+		Chunk *ck = &ch->chunks[ch->next++];
+		pthread_mutex_unlock(&ch->lock);
+
+		lex_chunk(ch->stream, ck);
+
+		pthread_mutex_lock(&ch->lock);
+		ck->done = true;
+		pthread_cond_broadcast(&ch->cond);
+	}
+	pthread_mutex_unlock(&ch->lock);
 	return NULL;
 }
 
+/*
+ * hands chunk ck downstream. *pos and *prev_type are the true lexer position
+ * and state, seq is a view used to lex whatever the chunk got wrong
+*/
+static bool stitch_chunk(Chunk *ck, cache *seq, Token_writer *w, size_t *pos, size_t *prev_type) {
+	size_t spec_type = CHUNK_GUESS;
+	bool status = true;
+	Token scratch;
+	while (status && *pos < ck->limit) {
+		TokenBlock *spec = token_stream_head(ck->tokens);
+		while (spec && spec->pos_base + spec->pos[spec->next] < *pos) {
+			// covered by a token that started earlier
+			spec_type = track_prev_type(spec_type, spec->type[spec->next++]);
+			spec = token_stream_head(ck->tokens);
+		}
+
+		tokentype type;
+		size_t length;
+		if (spec && spec->pos_base + spec->pos[spec->next] == *pos
+			&& regex_allowed(spec_type) == regex_allowed(*prev_type)) {
+			// in sync with the guess, take it
+			size_t i = spec->next++;
+			type = spec->type[i];
+			length = spec->length[i];
+			spec_type = track_prev_type(spec_type, type);
+			status = token_writer_copy(w, spec, i);
+		} else {
+			cache_view(seq, seq, *pos);
+			Token *tok = scan_token(seq, *prev_type, &scratch);
+			if (tok == NULL) {
+				fprintf(stderr, "Error parsing token at char position %ld\n", *pos);
+				channel_status_set_flag(w->out, LIST_MEMFAIL);
+				return false;
+			}
+			type = tok->type;
+			length = tok->length;
+			status = token_writer_put(w, tok, *pos);
+		}
+		*prev_type = track_prev_type(*prev_type, type);
+		*pos += length;
+	}
+	return status;
+}
+
+static bool gettokens_parallel(cache *stream, Token_writer *w, int workers) {
+	size_t size = cache_mapped_size(stream);
+	size_t chunk_size = size / ((size_t) workers * CHUNK_WINDOW);
+	// the window's blocks are held until stitched, keep them within the budget
+	size_t budget = channel_budget() / ((size_t) workers * CHUNK_WINDOW * CHUNK_BLOCK_RATIO);
+	if (budget && chunk_size > budget) {
+		chunk_size = budget;
+	}
+	if (chunk_size < CHUNK_SIZE) {
+		chunk_size = CHUNK_SIZE;
+	}
+
+	Chunker ch = {
+		.stream = stream,
+		.nchunks = (size + chunk_size - 1) / chunk_size,
+		.window = (size_t) workers * CHUNK_WINDOW,
+	};
+	if ((size_t) workers > ch.nchunks) {
+		workers = (int) ch.nchunks;
+	}
+	ch.chunks = (Chunk *) calloc(ch.nchunks, sizeof(Chunk));
+	pthread_t *tids = (pthread_t *) calloc(workers, sizeof(pthread_t));
+	if (!ch.chunks || !tids) {
+		free(ch.chunks);
+		free(tids);
+		return gettokens_serial(stream, w);
+	}
+
+	size_t i;
+	for (i = 0; i < ch.nchunks; i++) {
+		Chunk *ck = &ch.chunks[i];
+		ck->start = i ? chunk_start(stream, i * chunk_size) : 0;
+		ck->limit = size;
+		if (i) {
+			ch.chunks[i - 1].limit = ck->start;
+		}
+	}
+	for (i = 0; i < ch.nchunks; i++) {
+		// every block is kept until the chunk is stitched, make room for all
+		size_t len = ch.chunks[i].limit - ch.chunks[i].start;
+		if ((ch.chunks[i].tokens = token_stream_new(len / TOKEN_BLOCK_CAP + (len >> 32) + 2)) == NULL) {
+			ch.nchunks = i;
+			break;
+		}
+	}
+
+	pthread_mutex_init(&ch.lock, NULL);
+	pthread_cond_init(&ch.cond, NULL);
+	int started;
+	for (started = 0; started < workers; started++) {
+		if (pthread_create(&tids[started], NULL, chunk_worker, (void *) &ch) != 0) {
+			break;
+		}
+	}
+
+	cache seq;
+	cache_view(stream, &seq, 0);
+	size_t pos = 0;
+	size_t prev_type = TOKEN_NONE;
+	bool status = true;
+	for (i = 0; status && i < ch.nchunks; i++) {
+		Chunk *ck = &ch.chunks[i];
+		pthread_mutex_lock(&ch.lock);
+		if (ch.next == i) {
+			// no worker got to it yet, lex it here rather than wait
+			ch.next++;
+			pthread_mutex_unlock(&ch.lock);
+			lex_chunk(stream, ck);
+			pthread_mutex_lock(&ch.lock);
+			ck->done = true;
+		}
+		while (!ck->done) {
+			pthread_cond_wait(&ch.cond, &ch.lock);
+		}
+		pthread_mutex_unlock(&ch.lock);
+
+		status = stitch_chunk(ck, &seq, w, &pos, &prev_type);
+
+		pthread_mutex_lock(&ch.lock);
+		ch.stitched++;
+		pthread_cond_broadcast(&ch.cond);
+		pthread_mutex_unlock(&ch.lock);
+		channel_destroy(ck->tokens);
+		ck->tokens = NULL;
+	}
+
+	pthread_mutex_lock(&ch.lock);
+	ch.halt = true;
+	pthread_cond_broadcast(&ch.cond);
+	pthread_mutex_unlock(&ch.lock);
+	while (started--) {
+		pthread_join(tids[started], NULL);
+	}
+	for (; i < ch.nchunks; i++) {
+		if (ch.chunks[i].tokens) {
+			channel_destroy(ch.chunks[i].tokens);
+		}
+	}
+	pthread_cond_destroy(&ch.cond);
+	pthread_mutex_destroy(&ch.lock);
+	free(ch.chunks);
+	free(tids);
+
+	if (status) {
+		// whatever is left, normally just EOF
+		cache_view(stream, &seq, pos);
+		return gettokens_serial(&seq, w);
+	}
+	return status;
+}
+
+typedef struct {
+	cache *stream;
+	int workers;
+} Tokenizer_params;
+
+static void gettokens(Channel *in, Channel *tl, void *arg) {
+	Tokenizer_params *tp = (Tokenizer_params *) arg;
+	cache *stream = tp->stream;
+	int workers = tp->workers;
+	free(tp);
+
+	Token_writer w;
+	token_writer_init(&w, tl, (const char *) stream->map);
+	if (workers > 1 && cache_mapped_size(stream) >= 2 * CHUNK_SIZE) {
+		gettokens_parallel(stream, &w, workers);
+	} else {
+		gettokens_serial(stream, &w);
+	}
+	token_writer_flush(&w);
+}
+
 List *token_list_new(bool locked) {
 	return list_new(&token_free, locked);
 }
 
-List * tokenizer_start_thread(int fd) {
-	if (fd < 0) {
+bool tokenizer_lex_memory(const char *src, size_t len, size_t charnum, Channel *tokens) {
+	cache stream;
+	cache_memory(&stream, src, len, charnum);
+	Token_writer w;
+	token_writer_init(&w, tokens, NULL);
+	bool status = lex_serial(&stream, &w, false);
+	return token_writer_flush(&w) && status;
+}
+
+Channel * tokenizer_start_thread(cache *stream, int workers) {
+	if (!stream) {
 		return NULL;
 	}
-	List *list = token_list_new(true);
+	Channel *list = token_stream_new(channel_capacity(TOKEN_BLOCK_FOOTPRINT, TOKEN_STREAM_BLOCKS));
 	if (!list) {
 		return NULL;
 	}
 
-	Thread_params *t = (Thread_params *)malloc(sizeof(Thread_params));
-	if (!t) {
-		list_destroy(list);
+	Tokenizer_params *tp = (Tokenizer_params *)malloc(sizeof(Tokenizer_params));
+	if (!tp) {
+		channel_destroy(list);
 		return NULL;
 	}
+	tp->stream = stream;
+	tp->workers = workers;
 
-	t->input = malloc(sizeof(int));
-	if (!t->input) {
-		list_destroy(list);
-		free(t);
-		return NULL;
-	}
-
-	*(int *)t->input = fd;
-	t->output = (void *) list;
-
-	if (pthread_create(&list->thread->tid, &list->thread->attr, gettokens, (void *) t) != 0) {
-		fprintf(stderr, "[!!] pthread_create failed\n");
-		list_destroy(list);
+	if (!stage_start("tokenizer", NULL, list, gettokens, (void *) tp)) {
+		free(tp);
 		return NULL;
 	}
 	return list;
@@ -1,5 +1,7 @@
 #include <pthread.h>
 #include "list.h"
+#include "channel.h"
+#include "cache.h"
 
 #ifndef _TOKENGUARD
 #define _TOKENGUARD 1
@@ -111,38 +113,46 @@ typedef enum {
 
 } tokentype;
 
+// Token flags
+#define TOKEN_FLAG_RESERVED   (1 << 0) // keyword, never an identifier
+#define TOKEN_FLAG_CONTEXTUAL (1 << 1) // keyword only in strict mode or some positions
+
 typedef struct token_data Token;
 struct  token_data {
 	const char *value;
 	size_t length;
-	size_t charnum;
+	size_t charnum; // 0 for fake tokens, token blocks keep it for every token
 	tokentype type;
 	unsigned int flags;
-	bool fake; // for space tokens created during beautification, fake tokens lack origin locations and are not allocated.
+	unsigned int newlines; // whitespace runs only
+	bool fake; // shared flyweights, like fixed lexemes and the spaces added during beautification. Fake tokens lack origin locations, are not allocated and must not be written to.
 	bool isalloc, ishead;
 };
 
 /*
- * kick off the token producer, tokens will be added to the returned locked
- * list
+ * kick off the token producer, tokens will be added to the returned channel
+ * of token blocks, see token_block.h
+ *
+ * Tokens may point into the stream's memory, so the stream must outlive
+ * every token produced from it. Large mapped inputs are lexed in chunks by up
+ * to workers threads.
 */
-List * tokenizer_start_thread(int fd);
+Channel * tokenizer_start_thread(cache *stream, int workers);
 
 /*
- * unlinks first element of token list and puts it in the tok pointer
- *
- * If an element is not yet ready, this funciton blocks. The function will
- * return 0 on success. Non-zero means the list is empty and won't get any more
- * elements.
- *
- * Input is Thread_params ponter
+ * lexes len bytes of source made up on the way, like an unpacked payload,
+ * into blocks pushed on tokens, without an EOF token. Tokens are placed from
+ * charnum on. tokens must have room for every block, nothing takes them
+ * until this returns. False if memory ran out.
 */
-Token * token_list_dequeue(List *tl);
+bool tokenizer_lex_memory(const char *src, size_t len, size_t charnum, Channel *tokens);
 
 /*
- * consumes whitespace characters, returns the next token type
+ * every token with a fixed lexeme, by type. The value is NULL for the rest.
 */
-tokentype token_list_consume_white_peek(List *tl);
+extern const Token token_fixed[TOKEN_VARIABLE + 1];
+
+void token_free(void *v);
 
 /*
  * removes whitespace from tail of token list
@@ -151,11 +161,6 @@ void token_list_snip_white_tail(List *tl);
 
 Token * new_token_static(char *value, size_t type, size_t length, size_t charnum);
 
-/*
- * peeks the type of the next token in the list, does not consume the token
-*/
-tokentype token_list_peek_type(List *tl);
-
 List *token_list_new(bool locked);
 
 #endif
@@ -1,8 +1,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "tokenizer.h"
+#include "token_block.h"
 #include "lines.h"
-#include "threads.h"
+#include "stage.h"
 #include "line_utils.h"
 
 typedef enum {
@@ -20,7 +21,7 @@ typedef enum {
 	} \
 }
 
-static inline lineret handle_curly_close(List *tokens, Line *line) {
+static inline lineret handle_curly_close(Channel *tokens, Line *line) {
 	if (line->indent > 0) {
 		line->indent--;
 	}
@@ -38,7 +39,7 @@ static inline lineret handle_curly_close(List *tokens, Line *line) {
 	return LRET_END_DEC_INDENT;
 }
 
-static inline lineret fill_line(List *tokens, Line *line) {
+static inline lineret fill_line(Channel *tokens, Line *line) {
 	for (;;) {
 		Token *tok = token_list_dequeue (tokens);
 		if (!tok || tok->type == TOKEN_STOP) {
@@ -47,8 +48,19 @@ static inline lineret fill_line(List *tokens, Line *line) {
 
 		switch (tok->type) {
 		case TOKEN_NEWLINE:
-			// split on newline
-			tokens->free (tok);
+		case TOKEN_SPACE:
+		case TOKEN_TAB:
+		case TOKEN_CARRAGE_RETURN:
+			if (!tok->newlines) {
+				LINE_APPEND (line, tok);
+				break;
+			}
+			// split on newline, a longer run keeps the rest for printlines
+			if (tok->length == 1) {
+				token_free (tok);
+			} else {
+				LINE_APPEND (line, tok);
+			}
 			return LRET_END;
 		case TOKEN_SEMICOLON:
 		case TOKEN_OPEN_CURLY:
@@ -59,6 +71,7 @@ static inline lineret fill_line(List *tokens, Line *line) {
 			return handle_curly_close (tokens, line);
 
 		case TOKEN_EOF:
+			token_free (tok);
 			return LRET_END;
 		default:
 			LINE_APPEND (line, tok);
@@ -67,7 +80,7 @@ static inline lineret fill_line(List *tokens, Line *line) {
 	}
 }
 
-static inline void make_lines(List *tokens, List *lines) {
+static inline void make_lines(Channel *tokens, Line_writer *lines) {
 	size_t n = 0;
 	int indent = 0;
 	do {
@@ -77,7 +90,7 @@ static inline void make_lines(List *tokens, List *lines) {
 		}
 
 		lineret ret = fill_line (tokens, line);
-		if (!list_append_block (lines, line)) {
+		if (!line_writer_put (lines, line)) {
 			return;
 		}
 
@@ -106,44 +119,16 @@ static inline void make_lines(List *tokens, List *lines) {
 	} while (true);
 }
 
-static void *getlines(void *in) {
-	Thread_params *t = (Thread_params *) in;
-	List *tokens = (List *)t->input;
-	List *lines = (List *)t->output;
-	free (t);
-	make_lines (tokens, lines);
-	list_destroy (tokens);
-	list_producer_fin (lines);
-	return NULL;
+static void getlines(Channel *tokens, Channel *lines, void *arg) {
+	Line_writer w;
+	line_writer_init (&w, lines);
+	make_lines (tokens, &w);
+	line_writer_flush (&w);
 }
 
-List *ugly_lines_start_thread(List *tokens) {
+Channel *ugly_lines_start_thread(Channel *tokens) {
 	if (!tokens) {
 		return NULL;
 	}
-
-	List *lines = lines_list_new ();
-	if (!lines) {
-		list_destroy (tokens);
-		return NULL;
-	}
-
-	Thread_params *t = (Thread_params *)malloc (sizeof (Thread_params));
-	if (!t) {
-		list_destroy (tokens);
-		list_destroy (lines);
-		return NULL;
-	}
-
-	t->input = (void *)tokens;
-	t->output = (void *)lines;
-
-	if (pthread_create(&lines->thread->tid, &lines->thread->attr, getlines, (void *) t) != 0) {
-		fprintf(stderr, "[!!] pthread_create failed\n");
-		list_destroy (tokens);
-		list_destroy (lines);
-		free (t);
-		return NULL;
-	}
-	return lines;
+	return stage_start ("lines", tokens, lines_channel_new (), getlines, NULL);
 }
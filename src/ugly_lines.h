@@ -1,2 +1,2 @@
 
-List *ugly_lines_start_thread(List *tokens);
+Channel *ugly_lines_start_thread(Channel *tokens);
@@ -0,0 +1,387 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include "unpacker.h"
+#include "stage.h"
+#include "tokenizer.h"
+#include "token_block.h"
+
+/*
+ * Dean Edwards' packer wraps a whole script in
+ *
+ *   eval(function(p,a,c,k,e,d){...}('payload',radix,count,'w0|w1|...'.split('|'),0,{}))
+ *
+ * where every word of the payload is a number in base radix, standing for
+ * that entry of the word list. The call is recognised in the token stream,
+ * the payload unpacked here and lexed, and its tokens take the call's place.
+ * They go through the same matching, so a payload that was packed again is
+ * unpacked too.
+*/
+#define UNPACK_HELD  64 // blocks a call may span, longer ones are left alone
+#define UNPACK_DEPTH 8  // packed payloads inside packed payloads, at most
+#define UNPACK_RADIX 62 // the packer's High ASCII encoding, 95, isn't handled
+
+typedef struct {
+	Token_window win; // held blocks are tagged with their unpack depth
+	Token_writer w;
+} Unpacker;
+
+typedef enum {
+	UNPACK_NONE,    // no packer call, nothing was touched
+	UNPACK_DONE,    // the call was replaced by its payload
+	UNPACK_MEMFAIL, // the call was dropped but the payload couldn't go in
+} Unpack_result;
+
+static size_t unpacked;
+
+static bool is_word(const TokenBlock *b, uint32_t i, const char *word) {
+	size_t len = strlen(word);
+	return b->length[i] == len && memcmp(token_block_lexeme(b, i), word, len) == 0;
+}
+
+// takes the next solid token if it is of type t
+static bool expect(Unpacker *u, Token_pos *p, tokentype t) {
+	TokenBlock *b;
+	uint32_t i;
+	return token_window_next_solid(&u->win, p, &b, &i) == t;
+}
+
+static bool expect_word(Unpacker *u, Token_pos *p, const char *word) {
+	TokenBlock *b;
+	uint32_t i;
+	return token_window_next_solid(&u->win, p, &b, &i) == TOKEN_VARIABLE && is_word(b, i, word);
+}
+
+// skips to just past the close matching an open that was just taken
+static bool skip_nested(Unpacker *u, Token_pos *p, tokentype open, tokentype close) {
+	TokenBlock *b;
+	uint32_t i;
+	size_t depth = 1;
+	tokentype t;
+	while ((t = token_window_next_solid(&u->win, p, &b, &i)) != TOKEN_STOP) {
+		if (t == open) {
+			depth++;
+		} else if (t == close && --depth == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * the text of a '' or "" string literal, escapes resolved, NUL terminated.
+ * Never longer than the lexeme.
+*/
+static char *string_text(const TokenBlock *b, uint32_t i, size_t *text_len) {
+	const char *s = token_block_lexeme(b, i);
+	size_t len = b->length[i];
+	if (len < 2 || (s[0] != '\'' && s[0] != '"')) {
+		return NULL;
+	}
+	char *out = (char *) malloc(len);
+	if (!out) {
+		return NULL;
+	}
+	size_t o = 0;
+	for (size_t k = 1; k < len - 1; k++) {
+		if (s[k] != '\\' || k + 1 >= len - 1) {
+			out[o++] = s[k];
+			continue;
+		}
+		char c = s[++k];
+		unsigned int v = 0;
+		int digits = c == 'x' ? 2 : c == 'u' ? 4 : 0;
+		if (digits && k + digits < len - 1) {
+			int d;
+			for (d = 0; d < digits; d++) {
+				char h = s[k + 1 + d] | 0x20;
+				if (h >= '0' && h <= '9') {
+					v = v << 4 | (h - '0');
+				} else if (h >= 'a' && h <= 'f') {
+					v = v << 4 | (h - 'a' + 10);
+				} else {
+					break;
+				}
+			}
+			if (d == digits) {
+				k += digits;
+				// as UTF-8
+				if (v < 0x80) {
+					out[o++] = v;
+				} else if (v < 0x800) {
+					out[o++] = 0xc0 | v >> 6;
+					out[o++] = 0x80 | (v & 0x3f);
+				} else {
+					out[o++] = 0xe0 | v >> 12;
+					out[o++] = 0x80 | (v >> 6 & 0x3f);
+					out[o++] = 0x80 | (v & 0x3f);
+				}
+				continue;
+			}
+		}
+		switch (c) {
+		case 'n': out[o++] = '\n'; break;
+		case 'r': out[o++] = '\r'; break;
+		case 't': out[o++] = '\t'; break;
+		case 'b': out[o++] = '\b'; break;
+		case 'f': out[o++] = '\f'; break;
+		case 'v': out[o++] = '\v'; break;
+		case '0': out[o++] = '\0'; break;
+		case '\n': break; // line continuation
+		default: out[o++] = c; break;
+		}
+	}
+	out[o] = '\0';
+	*text_len = o;
+	return out;
+}
+
+static bool numeric_value(const TokenBlock *b, uint32_t i, long *v) {
+	char buf[16];
+	size_t len = b->length[i];
+	if (len >= sizeof(buf)) {
+		return false;
+	}
+	memcpy(buf, token_block_lexeme(b, i), len);
+	buf[len] = '\0';
+	char *end;
+	*v = strtol(buf, &end, 10);
+	return *end == '\0';
+}
+
+static inline bool is_word_char(char c) {
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static inline int digit_value(char c) {
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	} else if (c >= 'a' && c <= 'z') {
+		return c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'Z') {
+		return c - 'A' + 36;
+	}
+	return -1;
+}
+
+// the word's number, -1 if the packer would never have written it that way
+static long word_number(const char *w, size_t len, long radix) {
+	if (len > 1 && w[0] == '0') {
+		return -1;
+	}
+	long v = 0;
+	for (size_t k = 0; k < len; k++) {
+		int d = digit_value(w[k]);
+		if (d < 0 || d >= radix || v > (LONG_MAX - d) / radix) {
+			return -1;
+		}
+		v = v * radix + d;
+	}
+	return v;
+}
+
+/*
+ * what the packer's function returns: every word of the payload that is a
+ * number below count with a word list entry, replaced by that entry
+*/
+static char *unpack_payload(const char *p, size_t p_len, long radix, long count,
+	char *words, size_t words_len, size_t *out_len) {
+	// split the word list in place
+	size_t nwords = 1;
+	for (size_t k = 0; k < words_len; k++) {
+		nwords += words[k] == '|';
+	}
+	char **word = (char **) malloc(nwords * sizeof(char *));
+	if (!word) {
+		return NULL;
+	}
+	word[0] = words;
+	for (size_t k = 0, n = 1; k < words_len; k++) {
+		if (words[k] == '|') {
+			words[k] = '\0';
+			word[n++] = words + k + 1;
+		}
+	}
+
+	size_t cap = p_len + words_len + 1, o = 0;
+	char *out = (char *) malloc(cap);
+	for (size_t k = 0; out && k < p_len;) {
+		size_t start = k;
+		const char *put = p + k;
+		if (is_word_char(p[k])) {
+			while (k < p_len && is_word_char(p[k])) {
+				k++;
+			}
+			long v = word_number(p + start, k - start, radix);
+			if (v >= 0 && v < count && (size_t) v < nwords && *word[v]) {
+				put = word[v];
+			}
+		} else {
+			k++;
+		}
+		size_t n = put == p + start ? k - start : strlen(put);
+		if (o + n > cap) {
+			while (o + n > cap) {
+				cap *= 2;
+			}
+			char *grown = (char *) realloc(out, cap);
+			if (!grown) {
+				free(out);
+				out = NULL;
+				break;
+			}
+			out = grown;
+		}
+		memcpy(out + o, put, n);
+		o += n;
+	}
+	free(word);
+	*out_len = o;
+	return out;
+}
+
+/*
+ * matches a packer call starting at held[0]'s next token, `eval`. On a match
+ * the call is replaced: its tokens are dropped and the payload's go in
+ * front of what follows. UNPACK_NONE leaves everything as it was.
+*/
+static Unpack_result unpack(Unpacker *u) {
+	Token_pos p = { 0, u->win.held[0].b->next + 1 };
+	TokenBlock *b;
+	uint32_t i;
+	const char *params[] = { "p", "a", "c", "k", "e" };
+	if (!expect(u, &p, TOKEN_OPEN_PAREN) || !expect(u, &p, TOKEN_FUNCTION)
+		|| !expect(u, &p, TOKEN_OPEN_PAREN)) {
+		return UNPACK_NONE;
+	}
+	for (size_t n = 0; n < sizeof(params) / sizeof(params[0]); n++) {
+		if (!expect_word(u, &p, params[n]) || !expect(u, &p, TOKEN_COMMA)) {
+			return UNPACK_NONE;
+		}
+	}
+	if (token_window_next_solid(&u->win, &p, &b, &i) != TOKEN_VARIABLE || !(is_word(b, i, "d") || is_word(b, i, "r"))
+		|| !expect(u, &p, TOKEN_CLOSE_PAREN) || !expect(u, &p, TOKEN_OPEN_CURLY)
+		|| !skip_nested(u, &p, TOKEN_OPEN_CURLY, TOKEN_CLOSE_CURLY)
+		|| !expect(u, &p, TOKEN_OPEN_PAREN)) {
+		return UNPACK_NONE;
+	}
+
+	// the arguments
+	tokentype t = token_window_next_solid(&u->win, &p, &b, &i);
+	if (t != TOKEN_SINGLE_QUOTE_STRING && t != TOKEN_DOUBLE_QUOTE_STRING) {
+		return UNPACK_NONE;
+	}
+	TokenBlock *payload_b = b;
+	uint32_t payload_i = i;
+	long radix, count;
+	if (!expect(u, &p, TOKEN_COMMA)
+		|| token_window_next_solid(&u->win, &p, &b, &i) != TOKEN_NUMERIC || !numeric_value(b, i, &radix)
+		|| !expect(u, &p, TOKEN_COMMA)
+		|| token_window_next_solid(&u->win, &p, &b, &i) != TOKEN_NUMERIC || !numeric_value(b, i, &count)
+		|| !expect(u, &p, TOKEN_COMMA)
+		|| radix < 2 || radix > UNPACK_RADIX || count < 0) {
+		return UNPACK_NONE;
+	}
+	t = token_window_next_solid(&u->win, &p, &b, &i);
+	if (t != TOKEN_SINGLE_QUOTE_STRING && t != TOKEN_DOUBLE_QUOTE_STRING) {
+		return UNPACK_NONE;
+	}
+	TokenBlock *words_b = b;
+	uint32_t words_i = i;
+	if (!expect(u, &p, TOKEN_DOT) || !expect_word(u, &p, "split") || !expect(u, &p, TOKEN_OPEN_PAREN)) {
+		return UNPACK_NONE;
+	}
+	t = token_window_next_solid(&u->win, &p, &b, &i);
+	if ((t != TOKEN_SINGLE_QUOTE_STRING && t != TOKEN_DOUBLE_QUOTE_STRING) || b->length[i] != 3
+		|| token_block_lexeme(b, i)[1] != '|' || !expect(u, &p, TOKEN_CLOSE_PAREN)) {
+		return UNPACK_NONE;
+	}
+	// the rest of the call, then eval's own paren
+	if (!skip_nested(u, &p, TOKEN_OPEN_PAREN, TOKEN_CLOSE_PAREN) || !expect(u, &p, TOKEN_CLOSE_PAREN)) {
+		return UNPACK_NONE;
+	}
+
+	size_t payload_len, words_len, src_len;
+	char *payload = string_text(payload_b, payload_i, &payload_len);
+	char *words = string_text(words_b, words_i, &words_len);
+	char *src = payload && words
+		? unpack_payload(payload, payload_len, radix, count, words, words_len, &src_len) : NULL;
+	free(payload);
+	free(words);
+	if (!src) {
+		return UNPACK_NONE;
+	}
+
+	// room for every block the payload can make, see token_writer
+	Channel *nested = token_stream_new(src_len / TOKEN_BLOCK_CAP + 2 * src_len / TOKEN_BLOCK_BYTES + 4);
+	TokenBlock *first = u->win.held[0].b;
+	size_t charnum = first->pos_base + first->pos[first->next];
+	bool ok = nested && tokenizer_lex_memory(src, src_len, charnum, nested);
+	free(src);
+	if (!ok) {
+		channel_destroy(nested);
+		return UNPACK_NONE;
+	}
+	channel_producer_fin(nested);
+
+	// drop the call, then put the payload in front of what follows it
+	int depth = u->win.held[0].tag + 1;
+	token_window_seek(&u->win, p);
+	size_t at = 0;
+	while ((b = (TokenBlock *) channel_pop_block(nested)) != NULL) {
+		if (!token_window_insert(&u->win, at++, b, depth)) {
+			// the call is gone from the window, there is no going back
+			token_block_free(b);
+			channel_destroy(nested);
+			return UNPACK_MEMFAIL;
+		}
+	}
+	channel_destroy(nested);
+	unpacked++;
+	return UNPACK_DONE;
+}
+
+static void unpacker(Channel *in, Channel *out, void *arg) {
+	Unpacker u;
+	token_window_init(&u.win, in, UNPACK_HELD);
+	token_writer_init(&u.w, out, NULL);
+	bool status = true;
+	TokenBlock *b;
+	while (status && (b = token_window_block(&u.win, 0)) != NULL) {
+		if (b->next == b->count) {
+			token_window_drop(&u.win);
+			continue;
+		}
+		uint32_t i = b->next;
+		if (b->type[i] == TOKEN_VARIABLE && u.win.held[0].tag < UNPACK_DEPTH
+			&& is_word(b, i, "eval")) {
+			Unpack_result r = unpack(&u);
+			if (r == UNPACK_MEMFAIL) {
+				channel_status_set_flag(out, LIST_MEMFAIL);
+				break;
+			}
+			if (r == UNPACK_DONE) {
+				continue;
+			}
+		}
+		b->next++;
+		status = token_writer_copy(&u.w, b, i);
+	}
+	token_window_free(&u.win);
+	token_writer_flush(&u.w);
+}
+
+Channel *unpacker_start_thread(Channel *tokens) {
+	if (!tokens) {
+		return NULL;
+	}
+	Channel *out = token_stream_new(channel_capacity(TOKEN_BLOCK_FOOTPRINT, TOKEN_STREAM_BLOCKS));
+	return stage_start("unpacker", tokens, out, unpacker, NULL);
+}
+
+void unpacker_print_stats(FILE *f) {
+	if (unpacked) {
+		fprintf(f, "unpacker: %zu packed scripts unpacked\n", unpacked);
+	}
+}
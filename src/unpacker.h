@@ -0,0 +1,14 @@
+#ifndef _UNPACKERGUARD
+#define _UNPACKERGUARD 1
+#include <stdio.h>
+#include "channel.h"
+/*
+ * consumer of tokens, producer of tokens with scripts packed by Dean
+ * Edwards' packer, eval(function(p,a,c,k,e,d){...}(...)), replaced by
+ * their unpacked source
+*/
+Channel *unpacker_start_thread(Channel *tokens);
+
+// how many packed scripts the last run unpacked, nothing if none
+void unpacker_print_stats(FILE *f);
+#endif